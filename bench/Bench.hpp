@@ -0,0 +1,94 @@
+/**
+ * @file:	Bench.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/23 10:12:40 Monday
+ * @brief:	timing, argument and data helpers shared by the benchmarks
+ **/
+
+#ifndef __BENCH__H__
+#define __BENCH__H__
+
+#include <chrono>
+#include <charconv>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Adt.h"
+
+// ================================================================================================
+// Bench
+// ================================================================================================
+#pragma region Bench
+
+// seconds spent in `f`
+template <typename F>
+double timeIt(F&& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps the optimizer from dropping a value that is otherwise unused
+template <typename T>
+void keep(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// `--name <n>` from the command line, `fallback` when absent
+inline long argOf(int argc, char** argv, std::string_view name, long fallback)
+{
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (name != argv[i])
+            continue;
+        long value = fallback;
+        std::string_view text(argv[i + 1]);
+        std::from_chars(text.data(), text.data() + text.size(), value);
+        return value;
+    }
+    return fallback;
+}
+
+// `--name <text>` from the command line, `fallback` when absent
+inline std::string textOf(int argc, char** argv, std::string_view name, std::string fallback)
+{
+    for (int i = 1; i + 1 < argc; ++i)
+        if (name == argv[i])
+            return argv[i + 1];
+    return fallback;
+}
+
+// Todos with ids `first`.. and descriptions of 10 to 80 characters, a few of them needing JSON
+// escapes, roughly what the dashboards send. Seeded, so every run sees the same data.
+inline std::vector<Todo> makeTodos(std::size_t n, uint first = 1)
+{
+    static constexpr std::string_view kWords[] = {"buy", "milk", "call", "the", "plumber", "review", "PR", "\"urgent\"", "deploy", "fix", "flaky", "test", "caf\xc3\xa9", "tab\tseparated", "write", "docs"};
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<std::size_t> length(10, 80);
+    std::uniform_int_distribution<std::size_t> word(0, std::size(kWords) - 1);
+
+    std::vector<Todo> todos;
+    todos.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        std::string description;
+        auto target = length(rng);
+        while (description.size() < target)
+        {
+            if (!description.empty())
+                description.push_back(' ');
+            description.append(kWords[word(rng)]);
+        }
+        todos.push_back(Todo{first + static_cast<uint>(i), std::move(description), (rng() & 3) == 0});
+    }
+    return todos;
+}
+
+#pragma endregion Bench
+
+#endif  //!__BENCH__H__
@@ -0,0 +1,73 @@
+/**
+ * @file:	JsonEncode.cpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/23 15:26:48 Monday
+ * @brief:	JsonWriter against nlohmann's DOM and dump() for single todos and whole lists
+ **/
+
+#include <fmt/format.h>
+
+#include "Bench.hpp"
+
+// Both encoders must produce the same bytes; the list run mirrors GET /todos, the single-todo run
+// mirrors the per-mutation replies and broadcasts. JsonWriter reuses one buffer like the servers.
+//
+// usage: bench_json_encode [--todos 1000000] [--rounds 5]
+int main(int argc, char** argv)
+{
+    auto count = static_cast<std::size_t>(argOf(argc, argv, "--todos", 1'000'000));
+    auto rounds = static_cast<int>(argOf(argc, argv, "--rounds", 5));
+    auto todos = makeTodos(count);
+
+    std::string out;
+    JsonWriter w(out);
+    writeJson(w, todos);
+    if (out != nlohmann::json(todos).dump())
+    {
+        fmt::print(stderr, "JsonWriter and nlohmann disagree\n");
+        return 1;
+    }
+    auto bytes = static_cast<double>(out.size() * rounds);
+    fmt::print("{} todos, {:.1f} MiB of JSON per list\n", count, static_cast<double>(out.size()) / (1 << 20));
+
+    auto report = [&](const char* name, double secs)
+    {
+        fmt::print("{:<22} {:>8.1f} ms  {:>7.1f} MiB/s  {:>6.1f} ns/todo\n", name, secs * 1e3 / rounds, bytes / secs / (1 << 20), secs * 1e9 / (count * rounds));
+    };
+
+    report("list JsonWriter", timeIt([&]()
+                                     {
+                                         for (int r = 0; r < rounds; ++r)
+                                         {
+                                             out.clear();
+                                             JsonWriter w(out);
+                                             writeJson(w, todos);
+                                             keep(out);
+                                         } }));
+    report("list nlohmann", timeIt([&]()
+                                   {
+                                       for (int r = 0; r < rounds; ++r)
+                                       {
+                                           auto dumped = nlohmann::json(todos).dump();
+                                           keep(dumped);
+                                       } }));
+    report("single JsonWriter", timeIt([&]()
+                                       {
+                                           for (int r = 0; r < rounds; ++r)
+                                               for (const auto& todo : todos)
+                                               {
+                                                   out.clear();
+                                                   JsonWriter w(out);
+                                                   writeJson(w, todo);
+                                                   keep(out);
+                                               } }));
+    report("single nlohmann", timeIt([&]()
+                                     {
+                                         for (int r = 0; r < rounds; ++r)
+                                             for (const auto& todo : todos)
+                                             {
+                                                 auto dumped = nlohmann::json(todo).dump();
+                                                 keep(dumped);
+                                             } }));
+    return 0;
+}
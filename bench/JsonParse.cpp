@@ -0,0 +1,81 @@
+/**
+ * @file:	JsonParse.cpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/23 16:05:12 Monday
+ * @brief:	request body parse throughput, on-demand scanner against nlohmann's DOM
+ **/
+
+#include <fmt/format.h>
+
+#include "Bench.hpp"
+
+// Bodies as clients send them: one todo per POST /todo (formatted the way browsers' JSON.stringify
+// and curl users write them), a PATCH field mask, and POST /todos/batch arrays of 100.
+//
+// usage: bench_json_parse [--bodies 200000] [--rounds 5]
+int main(int argc, char** argv)
+{
+    auto count = static_cast<std::size_t>(argOf(argc, argv, "--bodies", 200'000));
+    auto rounds = static_cast<int>(argOf(argc, argv, "--rounds", 5));
+    auto todos = makeTodos(count);
+
+    std::vector<std::string> singles, patches, batches;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto pretty = nlohmann::json(todos[i]).dump(i % 4 == 0 ? 2 : -1);
+        singles.push_back(std::move(pretty));
+        patches.push_back(nlohmann::json{{"completed", todos[i].completed}}.dump());
+    }
+    for (std::size_t i = 0; i + 100 <= count; i += 100)
+        batches.push_back(nlohmann::json(std::vector<Todo>(todos.begin() + i, todos.begin() + i + 100)).dump());
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        // the scanner must take every body itself, not hand it to the fallback
+        if (!scanTodoFields(singles[i]))
+        {
+            fmt::print(stderr, "scanner gave up on body {}\n", i);
+            return 1;
+        }
+        auto todo = parseTodo(singles[i]);
+        if (todo.id != todos[i].id || todo.description != todos[i].description || todo.completed != todos[i].completed)
+        {
+            fmt::print(stderr, "scanner and nlohmann disagree on body {}\n", i);
+            return 1;
+        }
+    }
+
+    auto report = [rounds](const char* name, const std::vector<std::string>& bodies, double secs)
+    {
+        std::size_t bytes = 0;
+        for (const auto& body : bodies)
+            bytes += body.size();
+        fmt::print("{:<18} {:>8.1f} MiB/s  {:>7.0f} ns/body\n", name, static_cast<double>(bytes) * rounds / secs / (1 << 20), secs * 1e9 / (bodies.size() * rounds));
+    };
+    auto run = [rounds](const std::vector<std::string>& bodies, auto&& parse)
+    {
+        return timeIt([&]()
+                      {
+                          for (int r = 0; r < rounds; ++r)
+                              for (const auto& body : bodies)
+                              {
+                                  auto parsed = parse(body);
+                                  keep(parsed);
+                              } });
+    };
+
+    fmt::print("{} single bodies, {} batches of 100\n", singles.size(), batches.size());
+    report("todo scanner", singles, run(singles, [](const std::string& body)
+                                        { return parseTodo(body); }));
+    report("todo nlohmann", singles, run(singles, [](const std::string& body)
+                                         { return nlohmann::json::parse(body).get<Todo>(); }));
+    report("patch scanner", patches, run(patches, [](const std::string& body)
+                                         { return parseTodoFields(body); }));
+    report("patch nlohmann", patches, run(patches, [](const std::string& body)
+                                          { return fieldsOf(nlohmann::json::parse(body)); }));
+    report("batch scanner", batches, run(batches, [](const std::string& body)
+                                         { return parseTodos(body); }));
+    report("batch nlohmann", batches, run(batches, [](const std::string& body)
+                                          { return nlohmann::json::parse(body).get<std::vector<Todo>>(); }));
+    return 0;
+}
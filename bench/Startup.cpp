@@ -0,0 +1,107 @@
+/**
+ * @file:	Startup.cpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/24 09:31:52 Tuesday
+ * @brief:	recovery time from a snapshot plus log tail, against replaying the whole log
+ **/
+
+#include <fmt/format.h>
+
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+
+#include "Bench.hpp"
+#include "Snapshot.hpp"
+#include "Wal.hpp"
+
+// blocks until every record up to `lsn` is on disk
+static void waitDurable(Wal& wal, Wal::Lsn lsn)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool durable = false;
+    wal.whenDurable(lsn, [&]()
+                    {
+                        std::lock_guard lock(mutex);
+                        durable = true;
+                        cv.notify_one(); });
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&]()
+            { return durable; });
+}
+
+// Follows simple/Main.cpp: `--todos` creates are logged, then recovered by replaying the whole
+// log; a snapshot is written and the log compacted, `--tail` more modifications are logged, and
+// recovery runs again as Snapshot::load plus Wal::replay of the tail.
+//
+// usage: bench_startup [--todos 1000000] [--tail 100000] [--store columnar] [--shards 64] [--dir /tmp]
+int main(int argc, char** argv)
+{
+    auto count = static_cast<std::size_t>(argOf(argc, argv, "--todos", 1'000'000));
+    auto tail = static_cast<std::size_t>(argOf(argc, argv, "--tail", 100'000));
+    auto kind = textOf(argc, argv, "--store", "columnar");
+    auto shards = static_cast<std::size_t>(argOf(argc, argv, "--shards", 64));
+    auto dir = std::filesystem::path(textOf(argc, argv, "--dir", "/tmp"));
+    auto wal_path = (dir / "bench_startup.wal").string();
+    auto snapshot_path = (dir / "bench_startup.snap").string();
+    std::filesystem::remove(wal_path);
+    std::filesystem::remove(snapshot_path);
+
+    fmt::print("{} todos, {} tail records, {} store, {} hardware threads\n", count, tail, kind, std::thread::hardware_concurrency());
+    auto todos = makeTodoStore(kind, shards);
+    auto wal = std::make_unique<Wal>(wal_path, std::chrono::microseconds(1000));
+
+    // created in batches so the generated todos never all sit in memory next to the store
+    constexpr std::size_t kBatch = 1'000'000;
+    Wal::Lsn lsn = 0;
+    auto create_secs = timeIt([&]()
+                              {
+                                  for (std::size_t first = 1; first <= count; first += kBatch)
+                                  {
+                                      auto batch = makeTodos(std::min(kBatch, count + 1 - first), static_cast<uint>(first));
+                                      todos->upsertMany(batch, [&](const Todo& todo, std::string_view)
+                                                        { lsn = std::max(lsn, wal->append(WalOp::Upsert, todo)); });
+                                  }
+                                  waitDurable(*wal, lsn); });
+    fmt::print("{:<28} {:>9.0f} ms  ({:.0f} MiB log)\n", "create + log", create_secs * 1e3, static_cast<double>(std::filesystem::file_size(wal_path)) / (1 << 20));
+
+    {
+        auto recovered = makeTodoStore(kind, shards);
+        auto replay_secs = timeIt([&]()
+                                  { Wal::replay(wal_path, 0, *recovered); });
+        fmt::print("{:<28} {:>9.0f} ms  ({} todos)\n", "recover: replay whole log", replay_secs * 1e3, recovered->size());
+    }
+
+    Wal::Lsn covered = wal->durableLsn();
+    auto write_secs = timeIt([&]()
+                             { Snapshot::write(snapshot_path, *todos, covered); });
+    wal->compact(covered);
+    fmt::print("{:<28} {:>9.0f} ms  ({:.0f} MiB)\n", "snapshot write", write_secs * 1e3, static_cast<double>(std::filesystem::file_size(snapshot_path)) / (1 << 20));
+
+    auto modified = makeTodos(tail, 1);
+    for (auto& todo : modified)
+    {
+        todo.completed = !todo.completed;
+        todos->upsert(todo, [&](const Todo& todo, std::string_view)
+                      { lsn = wal->append(WalOp::Upsert, todo); });
+    }
+    waitDurable(*wal, lsn);
+    wal.reset();
+    fmt::print("{:<28} {:>12}  ({:.1f} MiB log after compaction)\n", "tail logged", "", static_cast<double>(std::filesystem::file_size(wal_path)) / (1 << 20));
+    todos.reset();
+
+    auto recovered = makeTodoStore(kind, shards);
+    std::optional<Wal::Lsn> from;
+    auto load_secs = timeIt([&]()
+                            { from = Snapshot::load(snapshot_path, *recovered); });
+    auto tail_secs = timeIt([&]()
+                            { Wal::replay(wal_path, from.value_or(0), *recovered); });
+    fmt::print("{:<28} {:>9.0f} ms\n", "recover: snapshot load", load_secs * 1e3);
+    fmt::print("{:<28} {:>9.0f} ms  ({} records)\n", "recover: replay tail", tail_secs * 1e3, tail);
+    fmt::print("{:<28} {:>9.0f} ms  ({} todos)\n", "recover: total", (load_secs + tail_secs) * 1e3, recovered->size());
+
+    std::filesystem::remove(wal_path);
+    std::filesystem::remove(snapshot_path);
+    return recovered->size() == count ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file:	StoreFootprint.cpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/23 14:02:17 Monday
+ * @brief:	heap bytes per todo and scan speed of each store layout against the plain map
+ **/
+
+#include <fmt/format.h>
+#include <malloc.h>
+
+#include <unordered_map>
+
+#include "Bench.hpp"
+
+// bytes currently handed out by malloc, small and mmap'd blocks alike
+static std::size_t heapInUse()
+{
+    auto info = ::mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Builds each layout from the same todos and reports what it holds on the heap, then how long a
+// count of the completed todos and a filtered visit take. `map` is the std::unordered_map<uint,
+// Todo> both servers used before the store layouts existed.
+//
+// usage: bench_store_footprint [--todos 1000000] [--shards 64]
+int main(int argc, char** argv)
+{
+    auto count = static_cast<std::size_t>(argOf(argc, argv, "--todos", 1'000'000));
+    auto shards = static_cast<std::size_t>(argOf(argc, argv, "--shards", 64));
+    auto todos = makeTodos(count);
+
+    std::size_t text = 0;
+    for (const auto& todo : todos)
+        text += todo.description.size();
+    fmt::print("{} todos, {:.1f} description bytes each on average\n", count, static_cast<double>(text) / count);
+
+    auto report = [count](const char* name, std::size_t bytes, double count_secs, double filter_secs)
+    {
+        fmt::print("{:<9} {:>7.1f} bytes/todo  {:>8.1f} MiB  count {:>7.2f} ms  filter {:>7.2f} ms\n",
+                   name, static_cast<double>(bytes) / count, static_cast<double>(bytes) / (1 << 20), count_secs * 1e3, filter_secs * 1e3);
+    };
+
+    {
+        auto before = heapInUse();
+        auto map = std::make_unique<std::unordered_map<uint, Todo>>();
+        for (const auto& todo : todos)
+            map->emplace(todo.id, todo);
+        auto bytes = heapInUse() - before;
+
+        std::size_t completed = 0;
+        auto count_secs = timeIt([&]()
+                                 { for (const auto& [id, todo] : *map) completed += todo.completed; });
+        std::size_t visited = 0;
+        auto filter_secs = timeIt([&]()
+                                  { for (const auto& [id, todo] : *map) if (todo.completed) visited += todo.id; });
+        keep(completed);
+        keep(visited);
+        report("map", bytes, count_secs, filter_secs);
+    }
+
+    for (const char* kind : {"hash", "slots", "columnar"})
+    {
+        auto before = heapInUse();
+        auto store = makeTodoStore(kind, shards);
+        store->upsertMany(todos);
+        auto bytes = heapInUse() - before;
+
+        std::size_t completed = 0;
+        auto count_secs = timeIt([&]()
+                                 { completed = store->countCompleted(); });
+        std::size_t visited = 0;
+        auto filter_secs = timeIt([&]()
+                                  { store->forEachWhere(true, [&visited](const Todo& todo)
+                                                        { visited += todo.id; }); });
+        keep(completed);
+        keep(visited);
+        report(kind, bytes, count_secs, filter_secs);
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file:	StoreWrites.cpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/23 10:40:05 Monday
+ * @brief:	write throughput of the todo store against the number of writer threads
+ **/
+
+#include <fmt/format.h>
+
+#include <thread>
+#include <utility>
+
+#include "Bench.hpp"
+
+// One shard stands for the single map and lock both servers used before sharding, the others for
+// the layouts selectable with --store. Every thread upserts random existing todos, as concurrent
+// PUT /todo requests from that many workers would.
+//
+// usage: bench_store_writes [--todos 1000000] [--ops 4000000] [--threads 8]
+int main(int argc, char** argv)
+{
+    auto count = static_cast<std::size_t>(argOf(argc, argv, "--todos", 1'000'000));
+    auto ops = static_cast<std::size_t>(argOf(argc, argv, "--ops", 4'000'000));
+    auto max_threads = static_cast<unsigned>(argOf(argc, argv, "--threads", 8));
+    auto todos = makeTodos(count);
+
+    fmt::print("{} todos, {} upserts per run, {} hardware threads\n", count, ops, std::thread::hardware_concurrency());
+    const std::pair<const char*, std::size_t> stores[] = {{"hash", 1}, {"hash", 64}, {"slots", 64}, {"columnar", 64}};
+    for (const auto& [kind, shards] : stores)
+    {
+        auto store = makeTodoStore(kind, shards);
+        store->upsertMany(todos);
+
+        double base = 0;
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+        {
+            auto secs = timeIt([&]()
+                               {
+                                   std::vector<std::thread> writers;
+                                   for (unsigned t = 0; t < threads; ++t)
+                                       writers.emplace_back([&, t]()
+                                                            {
+                                                                uint64_t x = 0x9e3779b97f4a7c15ull * (t + 1);
+                                                                for (std::size_t i = 0; i < ops / threads; ++i)
+                                                                {
+                                                                    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+                                                                    Todo todo = todos[x % count];
+                                                                    todo.completed = (x >> 32) & 1;
+                                                                    store->upsert(todo);
+                                                                } });
+                                   for (auto& writer : writers)
+                                       writer.join(); });
+            auto mops = static_cast<double>(ops / threads * threads) / secs / 1e6;
+            if (threads == 1)
+                base = mops;
+            fmt::print("{:<9} {:>3} shards  {:>2} threads  {:>7.2f} Mops/s  x{:.2f}\n", kind, shards, threads, mops, mops / base);
+        }
+    }
+    return 0;
+}
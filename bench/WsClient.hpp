@@ -0,0 +1,231 @@
+/**
+ * @file:	WsClient.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/24 13:20:44 Tuesday
+ * @brief:	minimal loopback websocket client for the benchmarks and tests
+ **/
+
+#ifndef __WSCLIENT__H__
+#define __WSCLIENT__H__
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// ================================================================================================
+// WsClient
+// ================================================================================================
+#pragma region WsClient
+
+// RFC 6455 over plain TCP to 127.0.0.1: upgrades with a fixed key, sends masked text frames and
+// parses the server's unmasked ones. No TLS, extensions or fragmented messages, which is all the
+// servers here ever send. A client that is never read from is how the tests play a slow consumer.
+class WsClient
+{
+public:
+    // `rcvbuf` > 0 shrinks the kernel receive buffer, so an unread client fills up sooner
+    explicit WsClient(uint16_t port, std::string_view path = "/", int rcvbuf = 0)
+    {
+        this->m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (this->m_fd < 0)
+            throw std::runtime_error(std::string("WsClient: socket: ") + std::strerror(errno));
+        int one = 1;
+        ::setsockopt(this->m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (rcvbuf > 0)
+            ::setsockopt(this->m_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::connect(this->m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            fail("connect");
+
+        std::string request = "GET " + std::string(path) +
+                              " HTTP/1.1\r\n"
+                              "Host: 127.0.0.1\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n\r\n";
+        this->writeAll(request);
+
+        // whatever follows the response headers is already frame data
+        std::size_t end;
+        while ((end = this->m_in.find("\r\n\r\n")) == std::string::npos)
+            if (!this->readSome(-1))
+                fail("handshake");
+        if (this->m_in.compare(0, 12, "HTTP/1.1 101") != 0)
+            throw std::runtime_error("WsClient: upgrade refused: " + this->m_in.substr(0, this->m_in.find("\r\n")));
+        this->m_in.erase(0, end + 4);
+    }
+
+    WsClient(WsClient&& other) noexcept
+        : m_fd(std::exchange(other.m_fd, -1)), m_in(std::move(other.m_in))
+    {
+    }
+
+    // disallow copy
+    WsClient(const WsClient&) = delete;
+    WsClient& operator=(const WsClient&) = delete;
+
+    ~WsClient()
+    {
+        if (this->m_fd >= 0)
+            ::close(this->m_fd);
+    }
+
+    [[nodiscard]] int fd() const noexcept
+    {
+        return this->m_fd;
+    }
+
+    void send(std::string_view text)
+    {
+        std::string frame;
+        frame.push_back(static_cast<char>(0x81));  // FIN | text
+        if (text.size() < 126)
+            frame.push_back(static_cast<char>(0x80 | text.size()));
+        else
+        {
+            frame.push_back(static_cast<char>(0x80 | 126));
+            frame.push_back(static_cast<char>(text.size() >> 8));
+            frame.push_back(static_cast<char>(text.size() & 0xff));
+        }
+        // a zero mask is a valid mask and leaves the payload as it is
+        frame.append(4, '\0');
+        frame.append(text);
+        this->writeAll(frame);
+    }
+
+    // Next whole frame as (opcode, payload), waiting up to `timeout_ms` (-1: forever, 0: only what
+    // is already buffered). Nullopt on timeout; throws once the server closed the connection.
+    std::optional<std::pair<uint8_t, std::string>> next(int timeout_ms = -1)
+    {
+        while (true)
+        {
+            if (auto frame = this->parse())
+                return frame;
+            if (!this->readSome(timeout_ms))
+            {
+                if (this->m_closed)
+                    throw std::runtime_error("WsClient: connection closed");
+                return std::nullopt;
+            }
+        }
+    }
+
+    // reads until `pred(opcode, payload)` holds for a frame, false if `timeout_ms` passes first
+    template <typename F>
+    bool waitFor(F&& pred, int timeout_ms)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (std::chrono::steady_clock::now() < deadline)
+            if (auto frame = this->next(100); frame && pred(frame->first, frame->second))
+                return true;
+        return false;
+    }
+
+    // Drains what the kernel holds without blocking and counts the complete frames. False once the
+    // server closed the connection.
+    bool drain(std::size_t& frames)
+    {
+        while (this->readSome(0))
+            while (this->parse())
+                ++frames;
+        while (this->parse())
+            ++frames;
+        return !this->m_closed;
+    }
+
+private:
+    [[noreturn]] void fail(const char* what)
+    {
+        throw std::runtime_error(std::string("WsClient: ") + what + ": " + std::strerror(errno));
+    }
+
+    void writeAll(std::string_view bytes)
+    {
+        while (!bytes.empty())
+        {
+            auto n = ::send(this->m_fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                fail("send");
+            bytes.remove_prefix(static_cast<std::size_t>(n));
+        }
+    }
+
+    // one read of whatever is available, after waiting up to `timeout_ms` for it
+    bool readSome(int timeout_ms)
+    {
+        pollfd pfd{this->m_fd, POLLIN, 0};
+        if (::poll(&pfd, 1, timeout_ms) <= 0)
+            return false;
+        char buffer[64 * 1024];
+        auto n = ::recv(this->m_fd, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+        {
+            this->m_closed = n == 0 || (errno != EINTR && errno != EAGAIN);
+            return false;
+        }
+        this->m_in.append(buffer, static_cast<std::size_t>(n));
+        return true;
+    }
+
+    // takes one complete server frame off the input, if there is one
+    std::optional<std::pair<uint8_t, std::string>> parse()
+    {
+        if (this->m_in.size() < 2)
+            return std::nullopt;
+        auto opcode = static_cast<uint8_t>(this->m_in[0] & 0x0f);
+        uint64_t len = static_cast<uint8_t>(this->m_in[1]) & 0x7f;
+        std::size_t header = 2;
+        if (len == 126)
+        {
+            if (this->m_in.size() < 4)
+                return std::nullopt;
+            len = (static_cast<uint64_t>(static_cast<uint8_t>(this->m_in[2])) << 8) | static_cast<uint8_t>(this->m_in[3]);
+            header = 4;
+        }
+        else if (len == 127)
+        {
+            if (this->m_in.size() < 10)
+                return std::nullopt;
+            len = 0;
+            for (int i = 2; i < 10; ++i)
+                len = (len << 8) | static_cast<uint8_t>(this->m_in[i]);
+            header = 10;
+        }
+        if (this->m_in.size() < header + len)
+            return std::nullopt;
+
+        std::pair<uint8_t, std::string> frame{opcode, this->m_in.substr(header, len)};
+        this->m_in.erase(0, header + len);
+        if (opcode == 0x8)
+            this->m_closed = true;
+        return frame;
+    }
+
+    int m_fd = -1;
+    std::string m_in;
+    bool m_closed = false;
+};
+
+#pragma endregion WsClient
+
+#endif  //!__WSCLIENT__H__
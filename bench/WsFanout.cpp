@@ -0,0 +1,109 @@
+/**
+ * @file:	WsFanout.cpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/24 15:02:09 Tuesday
+ * @brief:	broadcast fanout throughput of the simple server to many subscribers over loopback
+ **/
+
+#include <fmt/format.h>
+#include <sys/resource.h>
+
+#include <thread>
+
+#include "Bench.hpp"
+#include "TodoServer.h"
+#include "WsClient.hpp"
+
+// Starts the simple server in-process with `--workers` loops, connects `--subscribers` clients
+// (spread over the loops by the kernel) to the "random" topic, then publishes `--messages`
+// broadcasts of `--bytes` each, as mockServer does, and times until every client got every one.
+//
+// usage: bench_ws_fanout [--subscribers 10000] [--workers 8] [--messages 100] [--bytes 256] [--port 9101]
+int main(int argc, char** argv)
+{
+    auto subscribers = static_cast<std::size_t>(argOf(argc, argv, "--subscribers", 10'000));
+    auto workers = static_cast<uint>(argOf(argc, argv, "--workers", 8));
+    auto messages = static_cast<std::size_t>(argOf(argc, argv, "--messages", 100));
+    auto bytes = static_cast<std::size_t>(argOf(argc, argv, "--bytes", 256));
+    auto port = static_cast<uint16_t>(argOf(argc, argv, "--port", 9101));
+
+    // both ends of every connection live in this process
+    rlimit files{};
+    ::getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &files);
+    if (files.rlim_cur < 2 * subscribers + 64)
+    {
+        fmt::print(stderr, "need {} open files, the limit is {}\n", 2 * subscribers + 64, files.rlim_cur);
+        return 1;
+    }
+
+    auto server = std::make_shared<TodoServer>(makeTodoStore("hash", 64));
+    for (uint i = 1; i <= workers; ++i)
+        std::thread([server, i, port]()
+                    { server->startServer(i, port); })
+            .detach();
+
+    std::vector<WsClient> clients;
+    clients.reserve(subscribers);
+    auto connect_secs = timeIt([&]()
+                               {
+                                   while (clients.size() < subscribers)
+                                   {
+                                       try
+                                       {
+                                           auto& client = clients.emplace_back(port);
+                                           client.send(R"({"action": "subscribe", "topic": "random"})");
+                                           if (!client.waitFor([](uint8_t, const std::string& text)
+                                                               { return text.starts_with("Subscribed"); },
+                                                               10'000))
+                                               throw std::runtime_error("subscription not acknowledged");
+                                       }
+                                       catch (const std::exception&)
+                                       {
+                                           // the loops may still be starting up
+                                           if (clients.empty())
+                                               std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                                           else
+                                               throw;
+                                       }
+                                   } });
+    fmt::print("{} subscribers on {} workers connected in {:.0f} ms\n", subscribers, workers, connect_secs * 1e3);
+
+    std::vector<pollfd> fds;
+    for (const auto& client : clients)
+        fds.push_back(pollfd{client.fd(), POLLIN, 0});
+    std::vector<std::size_t> received(subscribers, 0);
+    std::size_t done = 0;
+
+    std::string payload(bytes, 'x');
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t m = 0; m < messages; ++m)
+        server->broadcastMessage("random", payload);
+    auto published = std::chrono::steady_clock::now();
+
+    while (done < subscribers && std::chrono::steady_clock::now() - start < std::chrono::seconds(120))
+    {
+        if (::poll(fds.data(), fds.size(), 100) <= 0)
+            continue;
+        for (std::size_t i = 0; i < fds.size(); ++i)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            bool was_done = received[i] >= messages;
+            if (!clients[i].drain(received[i]))
+                fds[i].fd = -1;
+            if (!was_done && received[i] >= messages)
+                ++done;
+        }
+    }
+    auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto publish_secs = std::chrono::duration<double>(published - start).count();
+
+    auto deliveries = static_cast<double>(subscribers * messages);
+    fmt::print("{} broadcasts of {} bytes published in {:.1f} ms\n", messages, bytes, publish_secs * 1e3);
+    fmt::print("{} of {} subscribers got all of them in {:.0f} ms: {:.2f} M deliveries/s, {:.0f} MiB/s\n",
+               done, subscribers, secs * 1e3, deliveries / secs / 1e6, deliveries * bytes / secs / (1 << 20));
+    // the server loops never return
+    std::_Exit(done == subscribers ? 0 : 1);
+}
@@ -11,11 +11,13 @@
 #include <fmt/format.h>
 
 #include <iostream>
+#include <tuple>
 #include <typeinfo>
 
 #include "Adt.h"
 #include "Helpers.hpp"
 #include "ISpi.h"
+#include "Routes.hpp"
 #include <nlohmann/json.hpp>
 
 // ================================================================================================
@@ -88,142 +90,19 @@ public:
         std::cout << "insert app_num: " << app_num << ", size: " << this->m_apps->size() << std::endl;
 
         // ================================================================================================
-        // get all todos
+        // HTTP routes: the built-in table, then the SPI's own when it declares one
         // ================================================================================================
-        auto get_all = [this](auto* res, auto* req)
-        {
-            auto all_todos = this->getSpiPtr()->procQueryTodos();
-            try
-            {
-                nlohmann::json j = nlohmann::json(all_todos);
-                res->end(j.dump());
-            }
-            catch (...)
-            {
-                res->writeStatus("500 Internal Server Error")->end("500 Internal Server Error: An unexpected condition was encountered.");
-            }
-        };
-        this->m_apps->at(app_num).get("/todos", get_all);
-
-        // ================================================================================================
-        // get todo
-        // ================================================================================================
-        auto get_todo = [this](auto* res, auto* req)
-        {
-            auto todo_id = std::stoi(std::string(req->getParameter(0)));
-            auto todo = this->getSpiPtr()->procQueryTodo(todo_id);
-            if (todo)
-            {
-                nlohmann::json j = nlohmann::json(todo.value());
-                res->end(j.dump());
-            }
-            else
-            {
-                res->writeStatus("400 Bad Request")->end(fmt::format("todo_id: {} not found.", todo_id));
-            }
-        };
-        this->m_apps->at(app_num).get("/todo/:id", get_todo);
-
-        // ================================================================================================
-        // create todo
-        // ================================================================================================
-        auto new_todo = [this](auto* res, auto* req)
-        {
-            auto isAborted = std::make_shared<bool>(false);
-            std::string buffer;
-            auto onData = [this,
-                           res,
-                           isAborted,
-                           buffer = std::move(buffer)](std::string_view data, bool last) mutable
-            {
-                buffer.append(data.data(), data.length());
-                if (last)
-                {
-                    try
-                    {
-                        Todo todo = nlohmann::json::parse(buffer);
-                        auto success = this->getSpiPtr()->procNewTodo(todo);
-                        if (success)
-                            res->end("success!");
-                        else
-                            res->end("failed!");
-                    }
-                    catch (nlohmann::json::exception& e)
-                    {
-                        res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
-                    }
-                    catch (...)
-                    {
-                        res->writeStatus("500 Internal Server Error")->end("500 Internal Server Error: An unexpected condition was encountered.");
-                    }
-                }
-            };
-
-            res->onData(onData);
-            res->onAborted([isAborted]()
-                           { *isAborted = true; });
-        };
-        this->m_apps->at(app_num).post("/todo", new_todo);
-
-        // ================================================================================================
-        // modify todo
-        // ================================================================================================
-        auto modify_todo = [this](auto* res, auto* req)
-        {
-            auto isAborted = std::make_shared<bool>(false);
-            std::string buffer;
-            auto onData = [this,
-                           res,
-                           isAborted,
-                           buffer = std::move(buffer)](std::string_view data, bool last) mutable
-            {
-                buffer.append(data.data(), data.length());
-                if (last)
-                {
-                    try
-                    {
-                        Todo todo = nlohmann::json::parse(buffer);
-                        auto success = this->getSpiPtr()->procModifyTodo(todo);
-                        if (success)
-                            res->end("success!");
-                        else
-                            res->end("failed!");
-                    }
-                    catch (nlohmann::json::exception& e)
-                    {
-                        res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
-                    }
-                    catch (...)
-                    {
-                        res->writeStatus("500 Internal Server Error")->end("500 Internal Server Error: An unexpected condition was encountered.");
-                    }
-                }
-            };
-
-            res->onData(onData);
-            res->onAborted([isAborted]()
-                           { *isAborted = true; });
-        };
-        this->m_apps->at(app_num).put("/todo/:id", modify_todo);
-
-        // ================================================================================================
-        // delete todo
-        // ================================================================================================
-        auto delete_todo = [this](auto* res, auto* req)
-        {
-            auto todoId = std::stoi(std::string(req->getParameter(0)));
-            auto success = this->getSpiPtr()->procDeleteTodo(todoId);
-            if (success)
-                res->end("success!");
-            else
-                res->end("failed!");
-        };
-        this->m_apps->at(app_num).del("/todo/:id", delete_todo);
+        auto& app = this->m_apps->at(app_num);
+        attachRoutes(*this, app, routes());
+        if constexpr (HasRoutes<T>)
+            attachRoutes(*this->getSpiPtr(), app, T::routes());
 
         // ================================================================================================
         // WebSocket route
         // ================================================================================================
         this->m_apps->at(app_num).template ws<WsData>("/*", {
+                                                                // one deflate stream per loop, no per-socket window
+                                                                .compression = uWS::SHARED_COMPRESSOR,
                                                                 .open = [this](auto* ws)
                                                                 { this->handleWebSocketConnection(ws); },
                                                                 .message = [this](auto* ws, std::string_view message, uWS::OpCode)
@@ -255,6 +134,226 @@ public:
     }
 
 private:
+    // ================================================================================================
+    // HTTP routes
+    // ================================================================================================
+
+    // Built-in route table. Ids are decoded from the path before a handler runs, a malformed one is
+    // answered with 400 and never reaches it.
+    static constexpr auto routes()
+    {
+        return std::tuple{
+            route<HttpMethod::Get, "/todos">(&TodoServer::getAllTodos),
+            route<HttpMethod::Get, "/todo/:id", uint>(&TodoServer::getTodo),
+            route<HttpMethod::Post, "/todo">(&TodoServer::newTodo),
+            route<HttpMethod::Put, "/todo/:id", uint>(&TodoServer::modifyTodo),
+            route<HttpMethod::Patch, "/todo/:id", uint>(&TodoServer::patchTodo),
+            route<HttpMethod::Del, "/todo/:id", uint>(&TodoServer::deleteTodo),
+            route<HttpMethod::Post, "/todos/batch">(&TodoServer::newTodos),
+            route<HttpMethod::Put, "/todos/batch">(&TodoServer::modifyTodos),
+            route<HttpMethod::Del, "/todos/batch">(&TodoServer::deleteTodos),
+        };
+    }
+
+    void getAllTodos(uWS::HttpResponse<false>* res, uWS::HttpRequest* req)
+    {
+        try
+        {
+            auto format = acceptedFormat(req->getHeader("accept"));
+            auto all_todos = this->getSpiPtr()->procQuerySnapshot();
+            // version 0 means the SPI does not version its todos
+            std::string etag = all_todos->version != 0 ? makeETag(all_todos->version, format) : std::string{};
+            if (!etag.empty() && etagMatches(req->getHeader("if-none-match"), etag))
+            {
+                // the status goes first, uWS writes "200 OK" ahead of any earlier header
+                res->writeStatus("304 Not Modified");
+                res->writeHeader("Vary", "Accept, Accept-Encoding");
+                res->writeHeader("ETag", etag);
+                res->endWithoutBody();
+                return;
+            }
+
+            // gzip bodies and small lists are rendered once per snapshot version, before any
+            // header so that a failure can still be answered with a 500; large and unversioned
+            // lists are rendered chunk by chunk as they are sent, never kept
+            const TodoBody* body = acceptsGzip(req->getHeader("accept-encoding")) ? &gzipTodos(all_todos, std::nullopt, format) : nullptr;
+            RenderedTodosPtr rendered = !body && all_todos->version != 0 ? renderTodos(all_todos, std::nullopt, format) : nullptr;
+
+            res->writeHeader("Vary", "Accept, Accept-Encoding");
+            if (!etag.empty())
+                res->writeHeader("ETag", etag);
+            if (format != WireFormat::Json)
+                res->writeHeader("Content-Type", mimeType(format));
+            if (body)
+            {
+                if (body->gzipped)
+                    res->writeHeader("Content-Encoding", "gzip");
+                res->end(body->body);
+                return;
+            }
+            if (rendered)
+                streamTodos(res, std::move(rendered));
+            else
+                streamTodos(res, TodoListWriter(std::move(all_todos), std::nullopt, format));
+        }
+        catch (...)
+        {
+            res->writeStatus("500 Internal Server Error")->end("500 Internal Server Error: An unexpected condition was encountered.");
+        }
+    }
+
+    void getTodo(uWS::HttpResponse<false>* res, uWS::HttpRequest* req, uint todoId)
+    {
+        auto todo = this->getSpiPtr()->procQueryTodo(todoId);
+        if (todo)
+        {
+            if (auto format = acceptedFormat(req->getHeader("accept")); format != WireFormat::Json)
+                res->writeHeader("Content-Type", mimeType(format))->end(toBinaryString(todo, format));
+            else
+                res->end(toJsonString(todo.value()));
+        }
+        else
+        {
+            res->writeStatus("400 Bad Request")->end(fmt::format("todo_id: {} not found.", todoId));
+        }
+    }
+
+    void newTodo(uWS::HttpResponse<false>* res, uWS::HttpRequest* req)
+    {
+        this->applyTodo(res, req, [this](const Todo& todo)
+                        { return this->getSpiPtr()->procNewTodo(todo); });
+    }
+
+    // the id in the path names the todo, whatever the body says
+    void modifyTodo(uWS::HttpResponse<false>* res, uWS::HttpRequest* req, uint todoId)
+    {
+        this->applyTodo(res, req, [this, todoId](Todo todo)
+                        {
+                            todo.id = todoId;
+                            return this->getSpiPtr()->procModifyTodo(todo); });
+    }
+
+    // only the fields in the body change; answered with the patched todo
+    void patchTodo(uWS::HttpResponse<false>* res, uWS::HttpRequest* req, uint todoId)
+    {
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto accepted = acceptedFormat(req->getHeader("accept"));
+        auto handle = [this, todoId, format, accepted](auto* res, std::string_view body)
+        {
+            try
+            {
+                auto todo = this->getSpiPtr()->procPatchTodo(todoId, parseTodoFields(body, format));
+                if (!todo)
+                    res->writeStatus("404 Not Found")->end(fmt::format("todo_id: {} not found.", todoId));
+                else if (accepted != WireFormat::Json)
+                    res->writeHeader("Content-Type", mimeType(accepted))->end(toBinaryString(todo, accepted));
+                else
+                    res->end(toJsonString(*todo));
+            }
+            catch (nlohmann::json::exception& e)
+            {
+                res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+            }
+            catch (...)
+            {
+                res->writeStatus("500 Internal Server Error")->end("500 Internal Server Error: An unexpected condition was encountered.");
+            }
+        };
+
+        onBody(res, req, handle);
+    }
+
+    void deleteTodo(uWS::HttpResponse<false>* res, uWS::HttpRequest*, uint todoId)
+    {
+        auto success = this->getSpiPtr()->procDeleteTodo(todoId);
+        if (success)
+            res->end("success!");
+        else
+            res->end("failed!");
+    }
+
+    // batches: POST/PUT take an array of todos, DELETE an array of ids
+    void newTodos(uWS::HttpResponse<false>* res, uWS::HttpRequest* req)
+    {
+        this->applyBatch(res, req, [this](std::string_view body, WireFormat format)
+                         {
+                             auto todos = parseTodos(body, format);
+                             return std::pair{this->getSpiPtr()->procNewTodos(todos), todos.size()}; });
+    }
+
+    void modifyTodos(uWS::HttpResponse<false>* res, uWS::HttpRequest* req)
+    {
+        this->applyBatch(res, req, [this](std::string_view body, WireFormat format)
+                         {
+                             auto todos = parseTodos(body, format);
+                             return std::pair{this->getSpiPtr()->procModifyTodos(todos), todos.size()}; });
+    }
+
+    void deleteTodos(uWS::HttpResponse<false>* res, uWS::HttpRequest* req)
+    {
+        this->applyBatch(res, req, [this](std::string_view body, WireFormat format)
+                         {
+                             auto todoIds = parseTodoIds(body, format);
+                             return std::pair{this->getSpiPtr()->procDeleteTodos(todoIds), todoIds.size()}; });
+    }
+
+    // decodes a single todo from the body and answers with what `apply` returned
+    template <typename F>
+    void applyTodo(uWS::HttpResponse<false>* res, uWS::HttpRequest* req, F apply)
+    {
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto handle = [apply, format](auto* res, std::string_view body)
+        {
+            try
+            {
+                auto success = apply(parseTodo(body, format));
+                if (success)
+                    res->end("success!");
+                else
+                    res->end("failed!");
+            }
+            catch (nlohmann::json::exception& e)
+            {
+                res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+            }
+            catch (...)
+            {
+                res->writeStatus("500 Internal Server Error")->end("500 Internal Server Error: An unexpected condition was encountered.");
+            }
+        };
+
+        onBody(res, req, handle);
+    }
+
+    // `apply(body, format)` returns how many of how many todos it applied
+    template <typename F>
+    void applyBatch(uWS::HttpResponse<false>* res, uWS::HttpRequest* req, F apply)
+    {
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto handle = [apply, format](auto* res, std::string_view body)
+        {
+            try
+            {
+                auto [applied, total] = apply(body, format);
+                res->end(fmt::format("{}! applied {}/{}", applied == total ? "success" : "failed", applied, total));
+            }
+            catch (nlohmann::json::exception& e)
+            {
+                res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+            }
+            catch (...)
+            {
+                res->writeStatus("500 Internal Server Error")->end("500 Internal Server Error: An unexpected condition was encountered.");
+            }
+        };
+
+        onBody(res, req, handle);
+    }
+
+    // ================================================================================================
+    // WebSocket
+    // ================================================================================================
+
     void handleWebSocketConnection(uWS::WebSocket<false, true, WsData>* ws)
     {
         auto tid = getTid();
@@ -262,9 +361,61 @@ private:
         ws->send(msg, uWS::OpCode::TEXT);
     }
 
+    // JSON messages with an "op" are RPC calls (see Helpers.hpp), anything else goes to the SPI
     void handleWebSocketMessage(uWS::WebSocket<false, true, WsData>* ws, std::string_view message)
     {
-        this->getSpiPtr()->procSubscribedMessage(message);
+        auto request = nlohmann::json::parse(message, nullptr, false);
+        if (!request.is_discarded() && isRpc(request))
+            ws->send(this->handleRpc(request), uWS::OpCode::TEXT);
+        else
+            this->getSpiPtr()->procSubscribedMessage(message);
+    }
+
+    // Dispatched to the same SPI calls as the HTTP routes, answered at once. The SPI owns its ids,
+    // so like POST /todo a create must name its `todo.id`; it is answered with the stored todo.
+    std::string handleRpc(const nlohmann::json& request)
+    {
+        auto id = rpcId(request);
+        try
+        {
+            auto call = parseRpc(request);
+            auto* spi = this->getSpiPtr();
+            auto done = [&id](bool success)
+            {
+                return rpcResult(id, [success](std::string& out)
+                                 { JsonWriter(out).boolean(success); });
+            };
+            switch (call.op)
+            {
+                case RpcOp::Create:
+                {
+                    if (!call.fields.id)
+                        return rpcError(id, "id is required");
+                    Todo todo{*call.fields.id, *call.fields.description, *call.fields.completed};
+                    if (!spi->procNewTodo(todo))
+                        return rpcError(id, fmt::format("todo_id: {} already exists.", todo.id));
+                    return rpcResult(id, [&todo](std::string& out)
+                                     { JsonWriter w(out); writeJson(w, todo); });
+                }
+                case RpcOp::Modify:
+                    return done(spi->procModifyTodo(Todo{*call.fields.id, call.fields.description.value_or(""), call.fields.completed.value_or(false)}));
+                case RpcOp::Delete:
+                    return done(spi->procDeleteTodo(call.todoId));
+                case RpcOp::Get:
+                    if (auto todo = spi->procQueryTodo(call.todoId))
+                        return rpcResult(id, [&todo](std::string& out)
+                                         { JsonWriter w(out); writeJson(w, *todo); });
+                    return rpcError(id, fmt::format("todo_id: {} not found.", call.todoId));
+                case RpcOp::List:
+                    return rpcResult(id, [spi, &call](std::string& out)
+                                     { TodoListWriter(spi->procQuerySnapshot(), call.completed).next(out, SIZE_MAX); });
+            }
+            return rpcError(id, "unknown op");
+        }
+        catch (const std::exception& e)
+        {
+            return rpcError(id, e.what());
+        }
     }
 
     void handleWebSocketClose(uWS::WebSocket<false, true, WsData>* ws)
@@ -0,0 +1,106 @@
+/**
+ * @file:	Changefeed.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/19 14:05:36 Thursday
+ * @brief:	sequence-numbered event log kept in a bounded ring for resuming subscribers
+ **/
+
+#ifndef __CHANGEFEED__H__
+#define __CHANGEFEED__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// ================================================================================================
+// Changefeed
+// ================================================================================================
+#pragma region Changefeed
+
+// Numbers events consecutively starting at 1 and keeps the last `capacity` of them, so a subscriber
+// that knows the last number it saw can be sent just the ones it missed. A number is taken when the
+// change it stands for is applied, the event arrives later, and events are released in number
+// order whatever order they arrive in.
+template <typename T>
+class Changefeed
+{
+public:
+    using Entry = std::pair<uint64_t, T>;
+
+    explicit Changefeed(std::size_t capacity)
+        : m_ring(std::max<std::size_t>(capacity, 1))
+    {
+    }
+
+    // disallow copy
+    Changefeed(const Changefeed&) = delete;
+    Changefeed& operator=(const Changefeed&) = delete;
+
+    // Takes the next number. Call while the change it numbers is still locked, so numbers follow
+    // the order changes were applied in; every number taken must then be `put`.
+    uint64_t reserve() noexcept
+    {
+        return this->m_reserved.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Keeps `entry` as number `seq`, evicting the oldest one when full. Once every earlier number
+    // is in, it and the entries that were waiting for it are handed to `release`, oldest first and
+    // under the feed lock, so whatever `release` publishes is published in sequence order. Keep
+    // `release` to queueing work that is already done.
+    template <typename F>
+    void put(uint64_t seq, T entry, F&& release)
+    {
+        std::lock_guard lock(this->m_mutex);
+        this->m_waiting.emplace(seq, std::move(entry));
+        for (auto it = this->m_waiting.begin(); it != this->m_waiting.end() && it->first == this->m_last + 1; it = this->m_waiting.erase(it))
+        {
+            auto& slot = this->m_ring[(it->first - 1) % this->m_ring.size()];
+            slot = Entry{it->first, std::move(it->second)};
+            ++this->m_last;
+            release(slot.second);
+        }
+    }
+
+    // Entries after `from`, oldest first. Nullopt when some of them were already evicted, or when
+    // `from` lies ahead of the feed (numbering restarts with the process).
+    std::optional<std::vector<Entry>> since(uint64_t from) const
+    {
+        std::lock_guard lock(this->m_mutex);
+        if (from > this->m_last || this->m_last - from > this->m_ring.size())
+            return std::nullopt;
+
+        std::vector<Entry> missed;
+        missed.reserve(this->m_last - from);
+        for (auto seq = from + 1; seq <= this->m_last; ++seq)
+            missed.push_back(this->m_ring[(seq - 1) % this->m_ring.size()]);
+        return missed;
+    }
+
+    [[nodiscard]] std::size_t capacity() const noexcept
+    {
+        return this->m_ring.size();
+    }
+
+    // number of the latest released event, 0 before the first one
+    [[nodiscard]] uint64_t last() const
+    {
+        std::lock_guard lock(this->m_mutex);
+        return this->m_last;
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<Entry> m_ring;
+    std::map<uint64_t, T> m_waiting;  // put ahead of an earlier number
+    uint64_t m_last = 0;
+    std::atomic<uint64_t> m_reserved{0};
+};
+
+#pragma endregion Changefeed
+
+#endif  //!__CHANGEFEED__H__
@@ -0,0 +1,150 @@
+/**
+ * @file:	JsonWriter.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/12 14:20:05 Thursday
+ * @brief:	streaming JSON encoder writing straight into a reusable buffer
+ **/
+
+#ifndef __JSONWRITER__H__
+#define __JSONWRITER__H__
+
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// ================================================================================================
+// JsonWriter
+// ================================================================================================
+#pragma region JsonWriter
+
+// Appends JSON tokens to a caller-owned std::string, so a buffer that is cleared and reused keeps
+// its capacity and encoding allocates nothing. Strings are escaped exactly like nlohmann's dump():
+// quote, backslash and control characters only, UTF-8 is passed through. Separators are left to
+// the caller.
+class JsonWriter
+{
+public:
+    explicit JsonWriter(std::string& out) noexcept
+        : m_out(out)
+    {
+    }
+
+    JsonWriter& raw(std::string_view text)
+    {
+        m_out.append(text);
+        return *this;
+    }
+
+    JsonWriter& raw(char c)
+    {
+        m_out.push_back(c);
+        return *this;
+    }
+
+    JsonWriter& boolean(bool value)
+    {
+        m_out.append(value ? "true" : "false");
+        return *this;
+    }
+
+    JsonWriter& number(uint64_t value)
+    {
+        char buf[20];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+        m_out.append(buf, end);
+        return *this;
+    }
+
+    JsonWriter& string(std::string_view text)
+    {
+        m_out.reserve(m_out.size() + text.size() + 2);
+        m_out.push_back('"');
+        while (!text.empty())
+        {
+            // copy the clean run in one go, then escape the byte that stopped it
+            auto clean = cleanPrefix(text);
+            m_out.append(text.data(), clean);
+            if (clean == text.size())
+                break;
+            escape(static_cast<unsigned char>(text[clean]));
+            text.remove_prefix(clean + 1);
+        }
+        m_out.push_back('"');
+        return *this;
+    }
+
+    // length of the prefix of `text` that needs no escaping
+    static std::size_t cleanPrefix(std::string_view text) noexcept
+    {
+        std::size_t i = 0;
+#if defined(__SSE2__)
+        // 16 bytes per step: '"', '\\' or anything <= 0x1F
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+        for (; i + 16 <= text.size(); i += 16)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+            __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+            if (auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits)))
+                return i + std::countr_zero(mask);
+        }
+#endif
+        for (; i < text.size(); ++i)
+        {
+            auto c = static_cast<unsigned char>(text[i]);
+            if (c == '"' || c == '\\' || c < 0x20)
+                return i;
+        }
+        return i;
+    }
+
+private:
+    void escape(unsigned char c)
+    {
+        switch (c)
+        {
+            case '"':
+                m_out.append("\\\"");
+                break;
+            case '\\':
+                m_out.append("\\\\");
+                break;
+            case '\b':
+                m_out.append("\\b");
+                break;
+            case '\f':
+                m_out.append("\\f");
+                break;
+            case '\n':
+                m_out.append("\\n");
+                break;
+            case '\r':
+                m_out.append("\\r");
+                break;
+            case '\t':
+                m_out.append("\\t");
+                break;
+            default:
+            {
+                static constexpr char hex[] = "0123456789abcdef";
+                char buf[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                m_out.append(buf, sizeof(buf));
+            }
+        }
+    }
+
+    std::string& m_out;
+};
+
+#pragma endregion JsonWriter
+
+#endif  //!__JSONWRITER__H__
@@ -11,67 +11,65 @@
 class MySpi : public ISpi
 {
 public:
-    MySpi(Todos todos, TodoMutex& todo_mutex)
-        : m_todos(todos), m_mutex(todo_mutex)
+    explicit MySpi(Todos todos)
+        : m_todos(todos)
     {
     }
 
     const std::vector<Todo> procQueryTodos() const
     {
-        std::shared_lock lock(this->m_mutex);
-        std::vector<Todo> all_todo;
-
-        for (const auto& [id, todo] : *this->m_todos.get())
-            all_todo.emplace_back(todo);
+        return this->m_todos->snapshot()->values();
+    };
 
-        return all_todo;
+    TodoSnapshotPtr procQuerySnapshot() const
+    {
+        return this->m_todos->snapshot();
     };
 
     std::optional<Todo> procQueryTodo(uint todoId) const
     {
-        std::shared_lock lock(this->m_mutex);
-        if (this->m_todos->find(todoId) != this->m_todos->end())
-            return this->m_todos->at(todoId);
-        else
-            return std::nullopt;
+        return this->m_todos->find(todoId);
     };
 
     bool procNewTodo(const Todo& todo)
     {
-        std::unique_lock lock(this->m_mutex);
-        auto todoId = todo.id;
-        if (this->m_todos->find(todoId) != this->m_todos->end())
-            return false;
-        else
-        {
-            this->m_todos->insert({todoId, todo});
-            return true;
-        }
+        return this->m_todos->insert(todo);
     };
 
     bool procModifyTodo(const Todo& todo)
     {
-        std::unique_lock lock(this->m_mutex);
-        auto todoId = todo.id;
-        if (this->m_todos->find(todoId) != this->m_todos->end())
-        {
-            this->m_todos->insert({todoId, todo});
-            return true;
-        }
-        else
-            return false;
+        return this->m_todos->update(todo);
     };
 
     bool procDeleteTodo(uint todoId)
     {
-        std::unique_lock lock(this->m_mutex);
-        if (this->m_todos->find(todoId) != this->m_todos->end())
+        return this->m_todos->erase(todoId).has_value();
+    };
+
+    std::size_t procNewTodos(const std::vector<Todo>& todos)
+    {
+        return this->m_todos->insertMany(todos);
+    };
+
+    std::size_t procModifyTodos(const std::vector<Todo>& todos)
+    {
+        return this->m_todos->updateMany(todos);
+    };
+
+    std::size_t procDeleteTodos(const std::vector<uint>& todoIds)
+    {
+        return this->m_todos->eraseMany(todoIds);
+    };
+
+    std::optional<Todo> procPatchTodo(uint todoId, const TodoFields& fields)
+    {
+        std::optional<Todo> patched;
+        auto keep = [&patched](const Todo& todo, std::string_view)
         {
-            this->m_todos->erase(todoId);
-            return true;
-        }
-        else
-            return false;
+            patched = todo;
+        };
+        this->m_todos->patch(todoId, fields, keep);
+        return patched;
     };
 
     void procSubscribedMessage(std::string_view message)
@@ -79,14 +77,31 @@ public:
         std::cout << "procSubscribedMessage: " << message << std::endl;
     };
 
+    // routes served next to the built-in ones
+    static constexpr auto routes()
+    {
+        return std::tuple{
+            route<HttpMethod::Get, "/todo/:id/description", uint>(&MySpi::getDescription),
+        };
+    }
+
+    void getDescription(uWS::HttpResponse<false>* res, uWS::HttpRequest*, uint todoId)
+    {
+        if (auto todo = this->m_todos->find(todoId))
+            res->end(todo->description);
+        else
+            res->writeStatus("404 Not Found")->end("not found");
+    }
+
 private:
     Todos m_todos;
-    TodoMutex& m_mutex;
 };
 
 int main(int argc, char** argv)
 {
     int workers = 1;  // Default workers set to 1
+    int shards = 64;  // Default todo store shards, rounded up to a power of two
+    std::string store = "hash";  // Todo storage: hash/slots/columnar
 
     // Check command-line arguments
     for (int i = 1; i < argc; ++i)
@@ -100,6 +115,18 @@ int main(int argc, char** argv)
             workers = std::stoi(argv[i + 1]);
             ++i;  // Skip the next argument since it's already processed
         }
+        // Check for --shards argument
+        else if (arg == "--shards" && (i + 1) < argc)
+        {
+            shards = std::stoi(argv[i + 1]);
+            ++i;
+        }
+        // Check for --store argument
+        else if (arg == "--store" && (i + 1) < argc)
+        {
+            store = argv[i + 1];
+            ++i;
+        }
     }
 
     // Output the number of workers
@@ -107,12 +134,11 @@ int main(int argc, char** argv)
 
     // ================================================================================================
 
-    auto todos = std::make_shared<std::unordered_map<uint, Todo>>();
-    auto todo_mutex = std::shared_mutex();
+    auto todos = makeTodoStore(store, shards);
     auto port = 9001;
 
     // spi
-    MySpi my(todos, todo_mutex);
+    MySpi my(todos);
 
     // lib (singleton
     std::shared_ptr<TodoServer<MySpi>> app = std::make_shared<TodoServer<MySpi>>();
@@ -0,0 +1,186 @@
+/**
+ * @file:	Routes.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/17 10:26:52 Tuesday
+ * @brief:	compile-time route descriptors with typed path parameters
+ **/
+
+#ifndef __ROUTES__H__
+#define __ROUTES__H__
+
+#include <algorithm>
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+#include <uWebSockets/App.h>
+
+enum class HttpMethod : uint8_t
+{
+    Get,
+    Post,
+    Put,
+    Patch,
+    Del,
+};
+
+// ================================================================================================
+// Path parameters
+// ================================================================================================
+#pragma region Params
+
+// Decoding of one path segment into a handler argument. Specialize it for other argument types;
+// `parse` returns false on anything it does not accept and must not throw.
+template <typename T>
+struct Param;
+
+template <std::integral T>
+struct Param<T>
+{
+    static bool parse(std::string_view text, T& out) noexcept
+    {
+        auto end = text.data() + text.size();
+        auto [p, ec] = std::from_chars(text.data(), end, out);
+        return !text.empty() && ec == std::errc() && p == end;
+    }
+};
+
+template <>
+struct Param<std::string_view>
+{
+    static bool parse(std::string_view text, std::string_view& out) noexcept
+    {
+        out = text;
+        return true;
+    }
+};
+
+// pattern as a template argument, e.g. "/todo/:id"
+template <std::size_t N>
+struct RoutePattern
+{
+    constexpr RoutePattern(const char (&text)[N])
+    {
+        std::copy_n(text, N, this->value);
+    }
+
+    [[nodiscard]] constexpr std::string_view view() const
+    {
+        return {this->value, N - 1};
+    }
+
+    char value[N]{};
+};
+
+// number of ":name" segments in a pattern
+constexpr std::size_t paramCount(std::string_view pattern)
+{
+    std::size_t n = 0;
+    for (std::size_t i = 0; i + 1 < pattern.size(); ++i)
+        n += pattern[i] == '/' && pattern[i + 1] == ':';
+    return n;
+}
+
+// name of the `index`th ":name" segment, without the colon
+constexpr std::string_view paramName(std::string_view pattern, std::size_t index)
+{
+    for (std::size_t i = 0; i + 1 < pattern.size(); ++i)
+    {
+        if (pattern[i] != '/' || pattern[i + 1] != ':')
+            continue;
+        auto begin = i + 2;
+        if (index-- == 0)
+            return pattern.substr(begin, pattern.find('/', begin) - begin);
+    }
+    return {};
+}
+
+#pragma endregion Params
+
+// ================================================================================================
+// Route
+// ================================================================================================
+#pragma region Route
+
+// One entry of a route table: method and pattern are part of the type, so the number of typed
+// parameters is checked against the pattern at compile time. The handler is invoked as
+// `handler(owner, res, req, params...)`, a member function pointer of the owner works as well as
+// a lambda. A segment that fails to decode is answered with 400 before the handler runs.
+template <HttpMethod Method, RoutePattern Pattern, typename F, typename... Params>
+struct Route
+{
+    static_assert(paramCount(Pattern.view()) == sizeof...(Params), "one typed parameter per :name segment");
+
+    F handler;
+
+    template <typename Owner, bool SSL>
+    void attach(Owner& owner, uWS::TemplatedApp<SSL>& app) const
+    {
+        auto handle = [&owner, handler = this->handler](uWS::HttpResponse<SSL>* res, uWS::HttpRequest* req)
+        {
+            std::tuple<Params...> params;
+            if (!decode(res, req, params, std::index_sequence_for<Params...>{}))
+                return;
+            std::apply([&](auto&... p)
+                       { std::invoke(handler, owner, res, req, p...); },
+                       params);
+        };
+
+        std::string pattern(Pattern.view());
+        if constexpr (Method == HttpMethod::Get)
+            app.get(pattern, std::move(handle));
+        else if constexpr (Method == HttpMethod::Post)
+            app.post(pattern, std::move(handle));
+        else if constexpr (Method == HttpMethod::Put)
+            app.put(pattern, std::move(handle));
+        else if constexpr (Method == HttpMethod::Patch)
+            app.patch(pattern, std::move(handle));
+        else
+            app.del(pattern, std::move(handle));
+    }
+
+private:
+    template <bool SSL, std::size_t... I>
+    static bool decode(uWS::HttpResponse<SSL>* res, uWS::HttpRequest* req, std::tuple<Params...>& params, std::index_sequence<I...>)
+    {
+        [[maybe_unused]] auto one = [res, req](auto index, auto& out)
+        {
+            auto text = req->getParameter(static_cast<unsigned short>(index.value));
+            if (Param<std::decay_t<decltype(out)>>::parse(text, out))
+                return true;
+            auto message = "invalid " + std::string(paramName(Pattern.view(), index.value)) + ": " + std::string(text);
+            res->writeStatus("400 Bad Request")->end(message);
+            return false;
+        };
+        return (one(std::integral_constant<std::size_t, I>{}, std::get<I>(params)) && ...);
+    }
+};
+
+// route<HttpMethod::Get, "/todo/:id", uint>(&Server::getTodo)
+template <HttpMethod Method, RoutePattern Pattern, typename... Params, typename F>
+constexpr auto route(F handler)
+{
+    return Route<Method, Pattern, F, Params...>{handler};
+}
+
+// registers every route of a table, in order, with `owner` as their first argument
+template <typename Owner, bool SSL, typename... Routes>
+void attachRoutes(Owner& owner, uWS::TemplatedApp<SSL>& app, const std::tuple<Routes...>& routes)
+{
+    std::apply([&](const auto&... r)
+               { (r.attach(owner, app), ...); },
+               routes);
+}
+
+// types contributing their own table through `static constexpr auto routes()`
+template <typename T>
+concept HasRoutes = requires { T::routes(); };
+
+#pragma endregion Route
+
+#endif  //!__ROUTES__H__
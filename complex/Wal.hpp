@@ -0,0 +1,504 @@
+/**
+ * @file:	Wal.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/09 10:02:41 Monday
+ * @brief:	append-only write-ahead log with group commit
+ **/
+
+#ifndef __WAL__H__
+#define __WAL__H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "Adt.h"
+
+enum class WalOp : uint8_t
+{
+    Upsert = 1,
+    Erase = 2,
+};
+
+// ================================================================================================
+// Wal
+// ================================================================================================
+#pragma region Wal
+
+// fsyncs the directory holding `path`, making a rename into it durable
+inline bool syncParentDir(const std::string& path)
+{
+    auto dir = std::filesystem::path(path).parent_path();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// File layout (little endian):
+//   header  = magic[8] | u64 base_lsn
+//   records = u32 payload_len | u32 crc32(payload) | payload = u8 op | u32 id | u8 completed | description
+//
+// Appends only copy the record into an in-memory batch; a single flusher thread writes and fsyncs
+// everything gathered during one flush interval, then fires the callbacks of every record that
+// became durable. One fsync is paid per batch instead of per request.
+//
+// Lsns count record bytes since the log was created and survive compaction, which drops the
+// records a snapshot already covers and records where the remaining ones start in `base_lsn`.
+// Logs written before the header existed are read as starting at 0.
+class Wal
+{
+public:
+    // logical offset just past a record, doubles as its log sequence number
+    using Lsn = uint64_t;
+    using Callback = std::function<void()>;
+
+    Wal(const std::string& path, std::chrono::microseconds flush_interval)
+        : m_path(path), m_interval(flush_interval)
+    {
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+            throw std::runtime_error("Wal: cannot open " + path + ": " + std::strerror(errno));
+
+        auto size = static_cast<std::size_t>(::lseek(m_fd, 0, SEEK_END));
+        char header[kFileHeader];
+        if (size == 0)
+        {
+            // made durable by the first group commit, before any record it precedes
+            encodeHeader(header, 0);
+            m_pending.append(header, kFileHeader);
+            m_header = size = kFileHeader;
+        }
+        else if (size >= kFileHeader && ::pread(m_fd, header, kFileHeader, 0) == static_cast<ssize_t>(kFileHeader))
+            std::tie(m_base, m_header) = decodeHeader(header, kFileHeader);
+
+        m_appended = m_durable = m_base + size - m_header;
+        m_flusher = std::thread([this]()
+                                { this->flushLoop(); });
+    }
+
+    // disallow copy
+    Wal(const Wal&) = delete;
+    Wal& operator=(const Wal&) = delete;
+
+    ~Wal()
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        m_flusher.join();
+        ::close(m_fd);
+    }
+
+    // Replays every intact record starting at `from` and returns the lsn after the last one. The
+    // log is mapped rather than read, so only the tail after `from` is touched. A torn tail left by
+    // a crash is cut off so later appends start on a record boundary. When `from` turns out not to
+    // be a record boundary the whole log is replayed instead, so a bad snapshot position can never
+    // make a durable record look torn. Throws when records before `from` were compacted away.
+    static Lsn replay(const std::string& path, Lsn from, const std::function<void(WalOp, Todo&&)>& apply)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return 0;
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return 0;
+        }
+        std::size_t size = static_cast<std::size_t>(st.st_size);
+        void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            throw std::runtime_error("Wal: cannot mmap " + path + ": " + std::strerror(errno));
+
+        const char* data = static_cast<const char*>(mapped);
+        auto [base, header] = decodeHeader(data, size);
+        Log log{data + header, base, base + size - header};
+        if (from < base)
+        {
+            ::munmap(mapped, size);
+            throw std::runtime_error("Wal: " + path + " starts at " + std::to_string(base) + ", after the snapshot position " +
+                                     std::to_string(from) + "; the records in between are gone");
+        }
+        if (from > log.end)
+        {
+            std::cerr << "Wal: " << path << " is shorter than the snapshot position, replaying it all" << std::endl;
+            from = base;
+        }
+
+        // skip the part a snapshot covers without faulting it in
+        ::madvise(mapped, size, MADV_SEQUENTIAL);
+        Lsn pos = scan(log, from, log.end, &apply);
+        if (pos < log.end && from != base && scan(log, base, from, nullptr) != from)
+        {
+            std::cerr << "Wal: snapshot position " << from << " is not a record boundary of " << path << ", replaying it all" << std::endl;
+            pos = scan(log, base, log.end, &apply);
+        }
+        ::munmap(mapped, size);
+
+        if (pos < log.end)
+        {
+            std::cerr << "Wal: discarding " << log.end - pos << " trailing bytes in " << path << std::endl;
+            if (::truncate(path.c_str(), static_cast<off_t>(header + pos - base)) != 0)
+                throw std::runtime_error("Wal: cannot truncate " + path + ": " + std::strerror(errno));
+        }
+        return pos;
+    }
+
+    // Replays into `todos`, applying runs of the same op as one batch so each shard is locked and
+    // published once per batch rather than once per record.
+    static Lsn replay(const std::string& path, Lsn from, TodoStore& todos)
+    {
+        std::vector<Todo> batch;
+        WalOp batchOp = WalOp::Upsert;
+        auto flush = [&]()
+        {
+            if (batchOp == WalOp::Upsert)
+                todos.upsertMany(batch);
+            else
+            {
+                std::vector<uint> ids;
+                ids.reserve(batch.size());
+                for (const auto& todo : batch)
+                    ids.push_back(todo.id);
+                todos.eraseMany(ids);
+            }
+            batch.clear();
+        };
+        auto pos = replay(path, from, [&](WalOp op, Todo&& todo)
+                          {
+                              if (op != batchOp || batch.size() == kReplayBatch)
+                              {
+                                  flush();
+                                  batchOp = op;
+                              }
+                              batch.push_back(std::move(todo)); });
+        flush();
+        return pos;
+    }
+
+    // Queues a record and returns its lsn. Call while the mutated todo is still locked so that the
+    // log order matches the in-memory order.
+    Lsn append(WalOp op, const Todo& todo)
+    {
+        uint32_t len = static_cast<uint32_t>(kFixedPayload + todo.description.size());
+        char fixed[kHeaderSize + kFixedPayload];
+        fixed[kHeaderSize] = static_cast<char>(op);
+        std::memcpy(fixed + kHeaderSize + 1, &todo.id, 4);
+        fixed[kHeaderSize + 5] = todo.completed ? 1 : 0;
+        std::memcpy(fixed, &len, 4);
+
+        uint32_t crc = ::crc32(0L, reinterpret_cast<const Bytef*>(fixed + kHeaderSize), kFixedPayload);
+        crc = ::crc32(crc, reinterpret_cast<const Bytef*>(todo.description.data()), todo.description.size());
+        std::memcpy(fixed + 4, &crc, 4);
+
+        std::lock_guard lock(m_mutex);
+        m_pending.append(fixed, sizeof(fixed));
+        m_pending.append(todo.description);
+        m_appended += kHeaderSize + len;
+        auto lsn = m_appended;
+        if (m_pending.size() == kHeaderSize + len)
+            m_cv.notify_one();
+        return lsn;
+    }
+
+    // Runs `cb` on the flusher thread once `lsn` is on disk, or right away if it already is.
+    void whenDurable(Lsn lsn, Callback cb)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            if (lsn > m_durable)
+            {
+                m_waiters.emplace_back(lsn, std::move(cb));
+                m_cv.notify_one();
+                return;
+            }
+        }
+        cb();
+    }
+
+    // Drops the records up to `upto` from the file once a durable snapshot covers them. The flusher
+    // copies the records after it into a fresh file and renames it over the log between two group
+    // commits, so appends never wait for it.
+    void compact(Lsn upto)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_compact = std::max(m_compact, upto);
+        }
+        m_cv.notify_one();
+    }
+
+    [[nodiscard]] Lsn durableLsn() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_durable;
+    }
+
+    // every record up to here has already been applied to the store
+    [[nodiscard]] Lsn appendedLsn() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_appended;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'T', 'O', 'D', 'O', 'W', 'A', 'L', '1'};
+    static constexpr std::size_t kFileHeader = 16;
+    static constexpr std::size_t kHeaderSize = 8;
+    static constexpr std::size_t kFixedPayload = 6;
+    static constexpr std::size_t kCopyBytes = 1 << 20;
+    static constexpr std::size_t kReplayBatch = 64 * 1024;
+
+    // the records of a mapped log: `data` holds the record at lsn `base`, up to `end`
+    struct Log
+    {
+        const char* data;
+        Lsn base;
+        Lsn end;
+    };
+
+    static void encodeHeader(char* header, Lsn base) noexcept
+    {
+        std::memcpy(header, kMagic, 8);
+        std::memcpy(header + 8, &base, 8);
+    }
+
+    // base lsn and header size of a log starting with `data`; logs without the magic predate it
+    static std::pair<Lsn, std::size_t> decodeHeader(const char* data, std::size_t size) noexcept
+    {
+        if (size < kFileHeader || std::memcmp(data, kMagic, 8) != 0)
+            return {0, 0};
+        return {load<uint64_t>(data + 8), kFileHeader};
+    }
+
+    template <typename T>
+    static T load(const char* p) noexcept
+    {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return v;
+    }
+
+    static uint32_t checksum(const char* p, std::size_t n) noexcept
+    {
+        return ::crc32(0L, reinterpret_cast<const Bytef*>(p), n);
+    }
+
+    // Walks the records from `pos` until reaching `until` or one that is torn or fails its checksum,
+    // handing each to `apply` when given. Returns where it stopped.
+    static Lsn scan(const Log& log, Lsn pos, Lsn until, const std::function<void(WalOp, Todo&&)>* apply)
+    {
+        while (pos < until && pos + kHeaderSize <= log.end)
+        {
+            const char* record = log.data + (pos - log.base);
+            auto len = load<uint32_t>(record);
+            auto crc = load<uint32_t>(record + 4);
+            const char* payload = record + kHeaderSize;
+
+            if (len < kFixedPayload || pos + kHeaderSize + len > log.end || crc != checksum(payload, len))
+                break;
+
+            if (apply)
+            {
+                auto op = static_cast<WalOp>(payload[0]);
+                Todo todo{
+                    load<uint32_t>(payload + 1),
+                    std::string(payload + kFixedPayload, len - kFixedPayload),
+                    payload[5] != 0,
+                };
+                (*apply)(op, std::move(todo));
+            }
+            pos += kHeaderSize + len;
+        }
+        return pos;
+    }
+
+    void flushLoop()
+    {
+        std::string batch;
+        std::vector<std::pair<Lsn, Callback>> waiters;
+
+        std::unique_lock lock(m_mutex);
+        while (true)
+        {
+            m_cv.wait(lock, [this]()
+                      { return m_stop || !m_pending.empty() || !m_waiters.empty() || m_compact > m_base; });
+            if (m_stop && m_pending.empty() && m_waiters.empty())
+                break;
+
+            // hold the group open so concurrent requests from every loop share this fsync
+            if (m_interval.count() > 0 && !m_stop)
+                m_cv.wait_for(lock, m_interval, [this]()
+                              { return m_stop; });
+
+            batch.swap(m_pending);
+            waiters.swap(m_waiters);
+            Lsn end = m_appended;
+            Lsn compact = std::min(m_compact, end);
+            lock.unlock();
+
+            if (!batch.empty())
+            {
+                writeAll(batch);
+                if (::fdatasync(m_fd) != 0)
+                    fail("fdatasync");
+                batch.clear();
+            }
+
+            lock.lock();
+            m_durable = end;
+            lock.unlock();
+
+            std::size_t kept = 0;
+            for (auto& waiter : waiters)
+            {
+                if (waiter.first <= end)
+                    waiter.second();
+                else
+                    waiters[kept++] = std::move(waiter);
+            }
+            waiters.resize(kept);
+
+            // the file now ends exactly at `end`
+            if (compact > m_base)
+                this->rewrite(compact, end);
+
+            lock.lock();
+            for (auto& waiter : waiters)
+                m_waiters.push_back(std::move(waiter));
+            waiters.clear();
+        }
+    }
+
+    // Replaces the log with the records in [upto, end). Runs on the flusher, the only writer of the
+    // file. On failure the old log stays in place and is still complete, the request is dropped and
+    // the next snapshot asks again; only the first of consecutive failures is logged.
+    void rewrite(Lsn upto, Lsn end)
+    {
+        auto tmp = this->m_path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        auto abandon = [&](const char* what)
+        {
+            if (!this->m_compact_failed)
+                std::cerr << "Wal: compaction " << what << " failed: " << std::strerror(errno) << std::endl;
+            this->m_compact_failed = true;
+            if (fd >= 0)
+                ::close(fd);
+            ::unlink(tmp.c_str());
+            std::lock_guard lock(this->m_mutex);
+            this->m_compact = this->m_base;
+        };
+        if (fd < 0)
+            return abandon("open");
+
+        std::string buffer(kFileHeader, '\0');
+        encodeHeader(buffer.data(), upto);
+        off_t from = static_cast<off_t>(this->m_header + (upto - this->m_base));
+        off_t to = static_cast<off_t>(this->m_header + (end - this->m_base));
+        while (true)
+        {
+            if (!buffer.empty() && !writeFd(fd, buffer))
+                return abandon("write");
+            if (from == to)
+                break;
+            buffer.resize(std::min<std::size_t>(kCopyBytes, static_cast<std::size_t>(to - from)));
+            auto n = ::pread(this->m_fd, buffer.data(), buffer.size(), from);
+            if (n < 0 && errno == EINTR)
+                n = 0;
+            else if (n <= 0)
+                return abandon("read");
+            buffer.resize(static_cast<std::size_t>(n));
+            from += n;
+        }
+        if (::fsync(fd) != 0)
+            return abandon("fsync");
+        if (::rename(tmp.c_str(), this->m_path.c_str()) != 0)
+            return abandon("rename");
+        if (!syncParentDir(this->m_path))
+            fail("directory fsync");
+
+        ::close(this->m_fd);
+        this->m_fd = fd;
+        this->m_header = kFileHeader;
+        this->m_compact_failed = false;
+        std::lock_guard lock(this->m_mutex);
+        this->m_base = upto;
+    }
+
+    void writeAll(const std::string& batch)
+    {
+        if (!writeFd(m_fd, batch))
+            fail("write");
+    }
+
+    static bool writeFd(int fd, const std::string& bytes)
+    {
+        const char* p = bytes.data();
+        std::size_t left = bytes.size();
+        while (left > 0)
+        {
+            auto n = ::write(fd, p, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return false;
+            p += n;
+            left -= static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    [[noreturn]] static void fail(const char* what)
+    {
+        // acknowledged writes can no longer be made durable
+        std::cerr << "Wal: " << what << " failed: " << std::strerror(errno) << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    std::string m_path;
+    int m_fd = -1;
+    std::chrono::microseconds m_interval;
+    // lsn of the first record in the file, and the size of the header before it
+    Lsn m_base = 0;
+    std::size_t m_header = 0;
+    bool m_compact_failed = false;  // flusher only, keeps a failing compaction from flooding the log
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::string m_pending;
+    std::vector<std::pair<Lsn, Callback>> m_waiters;
+    Lsn m_appended = 0;
+    Lsn m_durable = 0;
+    Lsn m_compact = 0;
+    bool m_stop = false;
+
+    std::thread m_flusher;
+};
+
+#pragma endregion Wal
+
+#endif  //!__WAL__H__
@@ -8,13 +8,27 @@
 #ifndef __ADT__H__
 #define __ADT__H__
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <stdexcept>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include "uWebSockets/App.h"
 #include <nlohmann/json.hpp>
 
+#include "BinaryWriter.hpp"
+#include "JsonReader.hpp"
+#include "JsonWriter.hpp"
+
 struct Todo
 {
     uint id;
@@ -46,13 +60,1668 @@ inline void from_json(const nlohmann::json& j, Todo& d)
     }
 }
 
-using Todos = std::shared_ptr<std::unordered_map<uint, Todo>>;
-using Apps = std::shared_ptr<std::unordered_map<uint, uWS::App>>;
+// Fields of a todo request body, each present only if the body had it
+struct TodoFields
+{
+    std::optional<uint> id;
+    std::optional<std::string> description;
+    std::optional<bool> completed;
+};
+
+// DOM of a request body in any wire format, for the cases the on-demand scanner does not cover
+inline nlohmann::json decodeBody(std::string_view body, WireFormat format)
+{
+    switch (format)
+    {
+        case WireFormat::MsgPack:
+            return nlohmann::json::from_msgpack(body.begin(), body.end());
+        case WireFormat::Cbor:
+            return nlohmann::json::from_cbor(body.begin(), body.end());
+        default:
+            return nlohmann::json::parse(body);
+    }
+}
+
+// Reads one flat todo object: id/description/completed are decoded in place, other scalar members
+// are skipped. Fails on anything else (malformed JSON, nested values, other field types).
+inline bool readTodoFields(JsonReader& r, TodoFields& fields)
+{
+    if (!r.consume('{'))
+        return false;
+    if (r.consume('}'))
+        return true;
+
+    std::string key;
+    do
+    {
+        if (!r.string(key) || !r.consume(':'))
+            return false;
+
+        bool ok;
+        if (key == "id")
+        {
+            uint64_t id = 0;
+            ok = r.number(id) && id <= UINT32_MAX;
+            fields.id = static_cast<uint>(id);
+        }
+        else if (key == "description")
+            ok = r.string(fields.description.emplace());
+        else if (key == "completed")
+            ok = r.boolean(fields.completed.emplace());
+        else
+            ok = r.skipScalar();
+        if (!ok)
+            return false;
+    } while (r.consume(','));
+
+    return r.consume('}');
+}
+
+// On-demand path for the flat objects clients send. Returns nullopt when the scanner gives up,
+// callers then hand the body to nlohmann for the full parse and its error.
+inline std::optional<TodoFields> scanTodoFields(std::string_view body)
+{
+    JsonReader r(body);
+    TodoFields fields;
+    if (!readTodoFields(r, fields) || !r.atEnd())
+        return std::nullopt;
+    return fields;
+}
+
+// same for a JSON array of todo objects
+inline std::optional<std::vector<TodoFields>> scanTodoFieldsList(std::string_view body)
+{
+    JsonReader r(body);
+    std::vector<TodoFields> list;
+    if (!r.consume('['))
+        return std::nullopt;
+    if (!r.consume(']'))
+    {
+        do
+        {
+            if (!readTodoFields(r, list.emplace_back()))
+                return std::nullopt;
+        } while (r.consume(','));
+        if (!r.consume(']'))
+            return std::nullopt;
+    }
+    if (!r.atEnd())
+        return std::nullopt;
+    return list;
+}
+
+// present members of a decoded object, throwing on wrong types like get<Todo>()
+inline TodoFields fieldsOf(const nlohmann::json& item)
+{
+    TodoFields fields;
+    if (!item.is_object())
+        throw nlohmann::json::type_error::create(302, "type must be object, but is " + std::string(item.type_name()), &item);
+    if (item.contains("id"))
+        fields.id = item.at("id").get<uint>();
+    if (item.contains("description"))
+        fields.description = item.at("description").get<std::string>();
+    if (item.contains("completed"))
+        fields.completed = item.at("completed").get<bool>();
+    return fields;
+}
+
+// TodoFields of every element of a JSON array body, throwing nlohmann exceptions on bad input
+inline std::vector<TodoFields> parseTodoFieldsList(std::string_view body, WireFormat format = WireFormat::Json)
+{
+    if (format == WireFormat::Json)
+    {
+        if (auto list = scanTodoFieldsList(body))
+            return std::move(*list);
+    }
+
+    std::vector<TodoFields> list;
+    for (const auto& item : decodeBody(body, format).get<std::vector<nlohmann::json>>())
+        list.push_back(fieldsOf(item));
+    return list;
+}
+
+// TodoFields of a single object body, e.g. the field mask of a PATCH
+inline TodoFields parseTodoFields(std::string_view body, WireFormat format = WireFormat::Json)
+{
+    if (format == WireFormat::Json)
+    {
+        if (auto fields = scanTodoFields(body))
+            return std::move(*fields);
+    }
+    return fieldsOf(decodeBody(body, format));
+}
+
+// full Todo from a request body, throwing nlohmann exceptions like `nlohmann::json::parse(body)`
+inline Todo parseTodo(std::string_view body, WireFormat format = WireFormat::Json)
+{
+    if (format != WireFormat::Json)
+        return decodeBody(body, format).get<Todo>();
+    if (auto fields = scanTodoFields(body); fields && fields->id && fields->description && fields->completed)
+        return Todo{*fields->id, std::move(*fields->description), *fields->completed};
+    return nlohmann::json::parse(body).get<Todo>();
+}
+
+// full Todos from a JSON array body
+inline std::vector<Todo> parseTodos(std::string_view body, WireFormat format = WireFormat::Json)
+{
+    if (format != WireFormat::Json)
+        return decodeBody(body, format).get<std::vector<Todo>>();
+    if (auto list = scanTodoFieldsList(body))
+    {
+        std::vector<Todo> todos;
+        todos.reserve(list->size());
+        for (auto& fields : *list)
+        {
+            if (!fields.id || !fields.description || !fields.completed)
+                break;
+            todos.push_back(Todo{*fields.id, std::move(*fields.description), *fields.completed});
+        }
+        if (todos.size() == list->size())
+            return todos;
+    }
+    return nlohmann::json::parse(body).get<std::vector<Todo>>();
+}
+
+// todo ids from a JSON array body such as `[1,2,3]`
+inline std::vector<uint> parseTodoIds(std::string_view body, WireFormat format = WireFormat::Json)
+{
+    if (format != WireFormat::Json)
+        return decodeBody(body, format).get<std::vector<uint>>();
+    JsonReader r(body);
+    std::vector<uint> ids;
+    bool ok = r.consume('[');
+    if (ok && !r.consume(']'))
+    {
+        do
+        {
+            uint64_t id = 0;
+            ok = r.number(id) && id <= UINT32_MAX;
+            ids.push_back(static_cast<uint>(id));
+        } while (ok && r.consume(','));
+        ok = ok && r.consume(']');
+    }
+    if (ok && r.atEnd())
+        return ids;
+    return nlohmann::json::parse(body).get<std::vector<uint>>();
+}
+
 using TodoMutex = std::shared_mutex;
 
+// streaming counterparts of to_json, same text as nlohmann's dump() without building a DOM
+inline void writeJson(JsonWriter& w, const Todo& todo)
+{
+    w.raw("{\"completed\":").boolean(todo.completed);
+    w.raw(",\"description\":").string(todo.description);
+    w.raw(",\"id\":").number(todo.id).raw('}');
+}
+
+inline void writeJson(JsonWriter& w, const std::vector<Todo>& todos)
+{
+    w.raw('[');
+    for (std::size_t i = 0; i < todos.size(); ++i)
+    {
+        if (i > 0)
+            w.raw(',');
+        writeJson(w, todos[i]);
+    }
+    w.raw(']');
+}
+
+// same fields and key order as writeJson, as a MessagePack or CBOR map
+inline void writeBinary(BinaryWriter& w, const Todo& todo)
+{
+    w.map(3);
+    w.string("completed").boolean(todo.completed);
+    w.string("description").string(todo.description);
+    w.string("id").number(todo.id);
+}
+
+inline void writeBinary(BinaryWriter& w, const std::vector<Todo>& todos)
+{
+    w.array(static_cast<uint32_t>(todos.size()));
+    for (const auto& todo : todos)
+        writeBinary(w, todo);
+}
+
+// Present fields only, same key order: the delta of a partial update
+inline void writeJson(JsonWriter& w, const TodoFields& fields)
+{
+    char separator = '{';
+    if (fields.completed)
+    {
+        w.raw(separator).raw("\"completed\":").boolean(*fields.completed);
+        separator = ',';
+    }
+    if (fields.description)
+    {
+        w.raw(separator).raw("\"description\":").string(*fields.description);
+        separator = ',';
+    }
+    if (fields.id)
+    {
+        w.raw(separator).raw("\"id\":").number(*fields.id);
+        separator = ',';
+    }
+    if (separator == '{')
+        w.raw('{');
+    w.raw('}');
+}
+
+inline void writeBinary(BinaryWriter& w, const TodoFields& fields)
+{
+    w.map(static_cast<uint32_t>(fields.completed.has_value() + fields.description.has_value() + fields.id.has_value()));
+    if (fields.completed)
+        w.string("completed").boolean(*fields.completed);
+    if (fields.description)
+        w.string("description").string(*fields.description);
+    if (fields.id)
+        w.string("id").number(*fields.id);
+}
+
+// Applies the fields present in `fields` (its id aside) to `todo`. An unchanged description is
+// left alone, so the string keeps its buffer.
+inline void applyFields(Todo& todo, const TodoFields& fields)
+{
+    if (fields.description && todo.description != *fields.description)
+        todo.description = *fields.description;
+    if (fields.completed)
+        todo.completed = *fields.completed;
+}
+
+// serialized JSON object of one todo, rendered once per write and cached next to it
+inline std::string toJsonString(const Todo& todo)
+{
+    std::string out;
+    out.reserve(48 + todo.description.size());
+    JsonWriter w(out);
+    writeJson(w, todo);
+    return out;
+}
+
+struct StoredTodo
+{
+    Todo todo;
+    std::string json;
+};
+
+// patches a stored todo in place and re-renders its cached JSON into the same buffer
+inline void patchStored(StoredTodo& stored, const TodoFields& fields)
+{
+    applyFields(stored.todo, fields);
+    stored.json.clear();
+    JsonWriter w(stored.json);
+    writeJson(w, stored.todo);
+}
+
+// called with the stored (or removed) todo and its JSON while its shard lock is still held, so
+// side effects such as journaling happen in the same order as the mutations themselves
+using TodoHook = std::function<void(const Todo&, std::string_view json)>;
+
+// ================================================================================================
+// TodoView
+// ================================================================================================
+
+// Immutable copy of one shard that readers use without taking its lock. It is a persistent radix
+// tree over `id >> shift`: leaves hold up to 8 todos sorted by id, inner nodes 16 children. A
+// writer copies only the nodes on the path to the todos it changes and shares the rest with the
+// views already handed out, so publishing costs O(depth) per write rather than O(shard).
+struct TodoNode
+{
+    uint64_t edit = 0;  // the TodoViewEdit that created it and may still change it in place
+    std::vector<std::shared_ptr<TodoNode>> children;  // inner nodes only, null where empty
+    std::vector<Todo> todos;  // leaves only
+};
+
+struct TodoView
+{
+    std::shared_ptr<TodoNode> root;
+    unsigned height = 0;  // inner levels above the leaves
+    unsigned shift = 0;   // id bits that select the shard
+    std::size_t size = 0;
+
+    // a view over a plain list, kept in its order; it is only ever read
+    static TodoView flat(std::vector<Todo> todos)
+    {
+        TodoView view;
+        view.size = todos.size();
+        view.root = std::make_shared<TodoNode>();
+        view.root->todos = std::move(todos);
+        return view;
+    }
+
+    // visits the leaves in id order
+    template <typename F>
+    void forEachLeaf(F&& f) const
+    {
+        if (this->root)
+            visit(*this->root, this->height, f);
+    }
+
+private:
+    template <typename F>
+    static void visit(const TodoNode& node, unsigned level, F& f)
+    {
+        if (level == 0)
+        {
+            f(node.todos);
+            return;
+        }
+        for (const auto& child : node.children)
+            if (child)
+                visit(*child, level - 1, f);
+    }
+};
+
+using TodoViewPtr = std::shared_ptr<const TodoView>;
+
+// Changes a copy of a view. Nodes copied by this edit are changed in place until `publish`, so a
+// batch copies each node it touches once. Call under the shard lock that orders the writers.
+class TodoViewEdit
+{
+public:
+    explicit TodoViewEdit(const TodoView& base)
+        : m_view(base), m_edit(nextEdit())
+    {
+    }
+
+    void put(const Todo& todo)
+    {
+        uint64_t key = todo.id >> this->m_view.shift;
+        if (!this->m_view.root)
+            this->m_view.height = 0;
+        while (key >> span(this->m_view.height))
+        {
+            if (this->m_view.root)
+            {
+                auto root = std::make_shared<TodoNode>();
+                root->edit = this->m_edit;
+                root->children.resize(kFanout);
+                root->children[0] = std::move(this->m_view.root);
+                this->m_view.root = std::move(root);
+            }
+            ++this->m_view.height;
+        }
+
+        auto* node = this->own(this->m_view.root);
+        for (auto level = this->m_view.height; level > 0; --level)
+        {
+            if (node->children.empty())
+                node->children.resize(kFanout);
+            node = this->own(node->children[(key >> span(level - 1)) & (kFanout - 1)]);
+        }
+
+        auto& todos = node->todos;
+        auto it = std::lower_bound(todos.begin(), todos.end(), todo.id, [](const Todo& t, uint id)
+                                   { return t.id < id; });
+        if (it != todos.end() && it->id == todo.id)
+            *it = todo;
+        else
+        {
+            todos.insert(it, todo);
+            ++this->m_view.size;
+        }
+    }
+
+    void erase(uint todoId)
+    {
+        uint64_t key = todoId >> this->m_view.shift;
+        if (this->contains(key, todoId) && !this->erase(this->m_view.root, this->m_view.height, key, todoId))
+            this->m_view.root.reset();
+    }
+
+    // the view as edited so far; later edits copy again whatever it shares
+    TodoViewPtr publish()
+    {
+        this->m_edit = nextEdit();
+        return std::make_shared<const TodoView>(this->m_view);
+    }
+
+    [[nodiscard]] const TodoView& view() const noexcept
+    {
+        return this->m_view;
+    }
+
+private:
+    static constexpr unsigned kLeafBits = 3;
+    static constexpr unsigned kInnerBits = 4;
+    static constexpr std::size_t kFanout = std::size_t{1} << kInnerBits;
+
+    static uint64_t nextEdit() noexcept
+    {
+        static std::atomic<uint64_t> next{0};
+        return next.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // key bits covered by a tree of `height` inner levels
+    static constexpr unsigned span(unsigned height) noexcept
+    {
+        return kLeafBits + kInnerBits * height;
+    }
+
+    // makes `node` one this edit may change, copying it unless this edit already did
+    TodoNode* own(std::shared_ptr<TodoNode>& node)
+    {
+        if (!node)
+            node = std::make_shared<TodoNode>();
+        else if (node->edit != this->m_edit)
+            node = std::make_shared<TodoNode>(*node);
+        node->edit = this->m_edit;
+        return node.get();
+    }
+
+    bool contains(uint64_t key, uint todoId) const
+    {
+        if (!this->m_view.root || key >> span(this->m_view.height))
+            return false;
+        const TodoNode* node = this->m_view.root.get();
+        for (auto level = this->m_view.height; level > 0 && node; --level)
+            node = node->children[(key >> span(level - 1)) & (kFanout - 1)].get();
+        return node && std::any_of(node->todos.begin(), node->todos.end(), [todoId](const Todo& t)
+                                   { return t.id == todoId; });
+    }
+
+    // removes a todo known to be present; returns false once `node` is left empty
+    bool erase(std::shared_ptr<TodoNode>& node, unsigned level, uint64_t key, uint todoId)
+    {
+        auto* owned = this->own(node);
+        if (level == 0)
+        {
+            std::erase_if(owned->todos, [todoId](const Todo& t)
+                          { return t.id == todoId; });
+            --this->m_view.size;
+            return !owned->todos.empty();
+        }
+        auto& child = owned->children[(key >> span(level - 1)) & (kFanout - 1)];
+        if (!this->erase(child, level - 1, key, todoId))
+            child.reset();
+        return std::any_of(owned->children.begin(), owned->children.end(), [](const auto& c)
+                           { return c != nullptr; });
+    }
+
+    TodoView m_view;
+    uint64_t m_edit;
+};
+
+// every todo as of one store version, shared by all readers that observe it; readers render it
+// piecewise (see TodoListWriter) rather than keeping the whole list as text
+struct TodoSnapshot
+{
+    uint64_t version = 0;
+    std::vector<TodoViewPtr> shards;
+
+    TodoSnapshot() = default;
+
+    TodoSnapshot(uint64_t version, std::vector<Todo> todos)
+        : version(version), shards{std::make_shared<const TodoView>(TodoView::flat(std::move(todos)))}
+    {
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        std::size_t n = 0;
+        for (const auto& shard : this->shards)
+            n += shard->size;
+        return n;
+    }
+
+    // visits the leaves of every shard, each a run of todos
+    template <typename F>
+    void forEachLeaf(F&& f) const
+    {
+        for (const auto& shard : this->shards)
+            shard->forEachLeaf(f);
+    }
+
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        this->forEachLeaf([&f](const std::vector<Todo>& todos)
+                          {
+                              for (const auto& todo : todos)
+                                  f(todo);
+                          });
+    }
+
+    std::vector<Todo> values() const
+    {
+        std::vector<Todo> todos;
+        todos.reserve(this->size());
+        this->forEach([&todos](const Todo& todo)
+                      { todos.push_back(todo); });
+        return todos;
+    }
+};
+
+using TodoSnapshotPtr = std::shared_ptr<const TodoSnapshot>;
+
+// ================================================================================================
+// TodoStore
+// ================================================================================================
+
+// Todo storage selected at startup. Implementations only provide the primitives; the version
+// counter and snapshot publishing are shared.
+class TodoStore
+{
+public:
+    TodoStore() = default;
+    virtual ~TodoStore() = default;
+
+    // disallow copy
+    TodoStore(const TodoStore&) = delete;
+    TodoStore& operator=(const TodoStore&) = delete;
+
+    virtual std::optional<Todo> find(uint todoId) const = 0;
+
+    // cached JSON of one todo
+    virtual std::optional<std::string> findJson(uint todoId) const = 0;
+
+    // insert only if `todo.id` is absent
+    virtual bool insert(const Todo& todo, const TodoHook& hook = nullptr) = 0;
+
+    // replace only if `todo.id` is present
+    virtual bool update(const Todo& todo, const TodoHook& hook = nullptr) = 0;
+
+    // insert or replace
+    virtual void upsert(const Todo& todo, const TodoHook& hook = nullptr) = 0;
+
+    // returns the removed todo, if any
+    virtual std::optional<Todo> erase(uint todoId, const TodoHook& hook = nullptr) = 0;
+
+    // Partial update: only the fields present in `fields` change, its id is ignored. Returns false
+    // when `todoId` is absent. The default reads, merges and replaces; stores override it to patch
+    // in place under one lock.
+    virtual bool patch(uint todoId, const TodoFields& fields, const TodoHook& hook = nullptr)
+    {
+        auto todo = find(todoId);
+        if (!todo)
+            return false;
+        applyFields(*todo, fields);
+        return update(*todo, hook);
+    }
+
+    // Batch forms of the above, returning how many todos were applied; `hook` runs for each of
+    // them. The defaults apply one todo at a time, stores override them to lock once per batch.
+    virtual std::size_t insertMany(const std::vector<Todo>& todos, const TodoHook& hook = nullptr)
+    {
+        std::size_t n = 0;
+        for (const auto& todo : todos)
+            n += insert(todo, hook);
+        return n;
+    }
+
+    virtual std::size_t updateMany(const std::vector<Todo>& todos, const TodoHook& hook = nullptr)
+    {
+        std::size_t n = 0;
+        for (const auto& todo : todos)
+            n += update(todo, hook);
+        return n;
+    }
+
+    virtual std::size_t upsertMany(const std::vector<Todo>& todos, const TodoHook& hook = nullptr)
+    {
+        for (const auto& todo : todos)
+            upsert(todo, hook);
+        return todos.size();
+    }
+
+    virtual std::size_t eraseMany(const std::vector<uint>& todoIds, const TodoHook& hook = nullptr)
+    {
+        std::size_t n = 0;
+        for (auto todoId : todoIds)
+            n += erase(todoId, hook).has_value();
+        return n;
+    }
+
+    // visits every todo; implementations lock one part of the store at a time
+    virtual void forEach(const std::function<void(const Todo&)>& f) const = 0;
+
+    // same as forEach, with each todo's cached JSON
+    virtual void forEachEntry(const std::function<void(const Todo&, std::string_view json)>& f) const = 0;
+
+    virtual std::size_t size() const = 0;
+
+    // visits the todos whose `completed` flag matches
+    virtual void forEachWhere(bool completed, const std::function<void(const Todo&)>& f) const
+    {
+        forEach([completed, &f](const Todo& todo)
+                { if (todo.completed == completed) f(todo); });
+    }
+
+    virtual std::size_t countCompleted() const
+    {
+        std::size_t n = 0;
+        forEach([&n](const Todo& todo)
+                { n += todo.completed; });
+        return n;
+    }
+
+    std::vector<Todo> values() const
+    {
+        std::vector<Todo> all_todo;
+        all_todo.reserve(size());
+        forEach([&all_todo](const Todo& todo)
+                { all_todo.push_back(todo); });
+        return all_todo;
+    }
+
+    uint maxId() const
+    {
+        uint largestKey = 0;
+        forEach([&largestKey](const Todo& todo)
+                { largestKey = std::max(largestKey, todo.id); });
+        return largestKey;
+    }
+
+    // bumped after every mutation, once it is published and while its todo is still locked
+    [[nodiscard]] uint64_t version() const noexcept
+    {
+        return m_version.load(std::memory_order_acquire);
+    }
+
+    // Returns the latest snapshot without taking any store lock: writers publish an immutable view
+    // of each shard they change (see TodoView), and a snapshot is just those views, reused until
+    // the next write. The version is read first and bumped only after publishing, so a snapshot
+    // holds at least every mutation its version counts.
+    TodoSnapshotPtr snapshot() const
+    {
+        auto version = this->version();
+        auto snap = m_snapshot.load(std::memory_order_acquire);
+        if (snap && snap->version == version)
+            return snap;
+
+        auto fresh = std::make_shared<TodoSnapshot>();
+        fresh->version = version;
+        this->loadViews(fresh->shards);
+        m_snapshot.store(fresh, std::memory_order_release);
+        return fresh;
+    }
+
+protected:
+    // appends the published view of every shard
+    virtual void loadViews(std::vector<TodoViewPtr>& views) const = 0;
+
+    void bumpVersion() noexcept
+    {
+        m_version.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+private:
+    alignas(64) std::atomic<uint64_t> m_version{0};
+    mutable std::atomic<TodoSnapshotPtr> m_snapshot;
+};
+
+// ================================================================================================
+// Slots
+// ================================================================================================
+
+// Per-shard containers used by ShardedStore. `key` is the todo id with the shard bits shifted
+// out, so sequential ids stay sequential within every shard.
+
+// node-based hash map, tolerant of any id distribution
+class HashSlots
+{
+public:
+    void configure(unsigned) noexcept
+    {
+    }
+
+    std::optional<Todo> get(uint todoId) const
+    {
+        auto it = m_map.find(todoId);
+        if (it == m_map.end())
+            return std::nullopt;
+        return it->second.todo;
+    }
+
+    std::optional<std::string> getJson(uint todoId) const
+    {
+        auto it = m_map.find(todoId);
+        if (it == m_map.end())
+            return std::nullopt;
+        return it->second.json;
+    }
+
+    bool add(const Todo& todo, const std::string& json)
+    {
+        return m_map.try_emplace(todo.id, StoredTodo{todo, json}).second;
+    }
+
+    bool replace(const Todo& todo, const std::string& json)
+    {
+        auto it = m_map.find(todo.id);
+        if (it == m_map.end())
+            return false;
+        it->second = StoredTodo{todo, json};
+        return true;
+    }
+
+    void put(const Todo& todo, const std::string& json)
+    {
+        m_map.insert_or_assign(todo.id, StoredTodo{todo, json});
+    }
+
+    template <typename F>
+    bool patch(uint todoId, const TodoFields& fields, F&& f)
+    {
+        auto it = m_map.find(todoId);
+        if (it == m_map.end())
+            return false;
+        patchStored(it->second, fields);
+        f(it->second.todo, it->second.json);
+        return true;
+    }
+
+    std::optional<StoredTodo> take(uint todoId)
+    {
+        auto node = m_map.extract(todoId);
+        if (!node)
+            return std::nullopt;
+        return std::move(node.mapped());
+    }
+
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        for (const auto& [id, stored] : m_map)
+            f(stored.todo);
+    }
+
+    template <typename F>
+    void forEachEntry(F&& f) const
+    {
+        for (const auto& [id, stored] : m_map)
+            f(stored.todo, stored.json);
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return m_map.size();
+    }
+
+private:
+    std::unordered_map<uint, StoredTodo> m_map;
+};
+
+// Maps ids to row positions through a vector indexed directly by key, no hashing. Keys far beyond
+// the dense range (client chosen ids) go to a small sparse map so they cannot blow up the vector.
+class DenseIndex
+{
+public:
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    void configure(unsigned shift) noexcept
+    {
+        m_shift = shift;
+    }
+
+    uint32_t find(uint todoId) const
+    {
+        auto k = key(todoId);
+        if (k < m_dense.size())
+            return m_dense[k];
+        if (m_sparse.empty())
+            return kNone;
+        auto it = m_sparse.find(todoId);
+        return it == m_sparse.end() ? kNone : it->second;
+    }
+
+    void set(uint todoId, uint32_t pos)
+    {
+        auto k = key(todoId);
+        if (k >= m_dense.size())
+        {
+            if (k >= 2 * m_dense.size() + kDenseSlack)
+            {
+                m_sparse.insert_or_assign(todoId, pos);
+                return;
+            }
+            grow(k);
+        }
+        m_dense[k] = pos;
+    }
+
+    void clear(uint todoId)
+    {
+        auto k = key(todoId);
+        if (k < m_dense.size())
+            m_dense[k] = kNone;
+        else
+            m_sparse.erase(todoId);
+    }
+
+private:
+    static constexpr std::size_t kDenseSlack = 4096;
+
+    std::size_t key(uint todoId) const noexcept
+    {
+        return todoId >> m_shift;
+    }
+
+    void grow(std::size_t k)
+    {
+        m_dense.resize(std::max(k + 1, m_dense.size() * 2), kNone);
+
+        // sparse ids that the vector now covers move into it
+        for (auto it = m_sparse.begin(); it != m_sparse.end();)
+        {
+            if (key(it->first) < m_dense.size())
+            {
+                m_dense[key(it->first)] = it->second;
+                it = m_sparse.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    unsigned m_shift = 0;
+    std::vector<uint32_t> m_dense;
+    std::unordered_map<uint, uint32_t> m_sparse;
+};
+
+// Todos packed in a vector and found through a DenseIndex. Erased entries become tombstones whose
+// positions are reused through a free list, and the vector is compacted once tombstones outnumber
+// live todos.
+class DenseSlots
+{
+public:
+    void configure(unsigned shift) noexcept
+    {
+        m_index.configure(shift);
+    }
+
+    std::optional<Todo> get(uint todoId) const
+    {
+        auto pos = m_index.find(todoId);
+        if (pos == DenseIndex::kNone)
+            return std::nullopt;
+        return m_todos[pos].todo;
+    }
+
+    std::optional<std::string> getJson(uint todoId) const
+    {
+        auto pos = m_index.find(todoId);
+        if (pos == DenseIndex::kNone)
+            return std::nullopt;
+        return m_todos[pos].json;
+    }
+
+    bool add(const Todo& todo, const std::string& json)
+    {
+        if (m_index.find(todo.id) != DenseIndex::kNone)
+            return false;
+        place(todo, json);
+        return true;
+    }
+
+    bool replace(const Todo& todo, const std::string& json)
+    {
+        auto pos = m_index.find(todo.id);
+        if (pos == DenseIndex::kNone)
+            return false;
+        m_todos[pos] = StoredTodo{todo, json};
+        return true;
+    }
+
+    void put(const Todo& todo, const std::string& json)
+    {
+        if (!replace(todo, json))
+            place(todo, json);
+    }
+
+    template <typename F>
+    bool patch(uint todoId, const TodoFields& fields, F&& f)
+    {
+        auto pos = m_index.find(todoId);
+        if (pos == DenseIndex::kNone)
+            return false;
+        patchStored(m_todos[pos], fields);
+        f(m_todos[pos].todo, m_todos[pos].json);
+        return true;
+    }
+
+    std::optional<StoredTodo> take(uint todoId)
+    {
+        auto pos = m_index.find(todoId);
+        if (pos == DenseIndex::kNone)
+            return std::nullopt;
+
+        StoredTodo removed = std::move(m_todos[pos]);
+        m_todos[pos] = StoredTodo{};
+        m_live[pos] = 0;
+        m_index.clear(todoId);
+        m_free.push_back(pos);
+
+        if (m_free.size() > kCompactMin && m_free.size() > size())
+            compact();
+        return removed;
+    }
+
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        for (std::size_t pos = 0; pos < m_todos.size(); ++pos)
+            if (m_live[pos])
+                f(m_todos[pos].todo);
+    }
+
+    template <typename F>
+    void forEachEntry(F&& f) const
+    {
+        for (std::size_t pos = 0; pos < m_todos.size(); ++pos)
+            if (m_live[pos])
+                f(m_todos[pos].todo, m_todos[pos].json);
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return m_todos.size() - m_free.size();
+    }
+
+private:
+    static constexpr std::size_t kCompactMin = 1024;
+
+    void place(const Todo& todo, const std::string& json)
+    {
+        uint32_t pos;
+        if (m_free.empty())
+        {
+            pos = static_cast<uint32_t>(m_todos.size());
+            m_todos.push_back(StoredTodo{todo, json});
+            m_live.push_back(1);
+        }
+        else
+        {
+            pos = m_free.back();
+            m_free.pop_back();
+            m_todos[pos] = StoredTodo{todo, json};
+            m_live[pos] = 1;
+        }
+        m_index.set(todo.id, pos);
+    }
+
+    void compact()
+    {
+        std::size_t next = 0;
+        for (std::size_t pos = 0; pos < m_todos.size(); ++pos)
+        {
+            if (!m_live[pos])
+                continue;
+            if (pos != next)
+            {
+                m_todos[next] = std::move(m_todos[pos]);
+                m_index.set(m_todos[next].todo.id, static_cast<uint32_t>(next));
+            }
+            ++next;
+        }
+        m_todos.resize(next);
+        m_todos.shrink_to_fit();
+        m_live.assign(next, 1);
+        m_free.clear();
+    }
+
+    DenseIndex m_index;
+    std::vector<StoredTodo> m_todos;
+    std::vector<uint8_t> m_live;
+    std::vector<uint32_t> m_free;
+};
+
+// Todos stored column by column: ids, a completed bitset and descriptions as (offset, length)
+// into one append-only arena. Filters and counts over `completed` scan 64 todos per word without
+// touching descriptions, and a todo costs about 16 bytes plus its text instead of a hash node
+// holding a std::string. Rows and arena bytes left behind by erases and rewrites are reclaimed
+// by compaction once they outweigh the live data.
+class ColumnarSlots
+{
+public:
+    void configure(unsigned shift) noexcept
+    {
+        m_index.configure(shift);
+    }
+
+    std::optional<Todo> get(uint todoId) const
+    {
+        auto pos = m_index.find(todoId);
+        if (pos == DenseIndex::kNone)
+            return std::nullopt;
+        return row(pos);
+    }
+
+    // descriptions are not duplicated into cached JSON here, it is rendered on demand
+    std::optional<std::string> getJson(uint todoId) const
+    {
+        auto todo = get(todoId);
+        if (!todo)
+            return std::nullopt;
+        return toJsonString(*todo);
+    }
+
+    bool add(const Todo& todo, const std::string&)
+    {
+        if (m_index.find(todo.id) != DenseIndex::kNone)
+            return false;
+        place(todo);
+        return true;
+    }
+
+    bool replace(const Todo& todo, const std::string&)
+    {
+        auto pos = m_index.find(todo.id);
+        if (pos == DenseIndex::kNone)
+            return false;
+        assign(pos, todo);
+        return true;
+    }
+
+    void put(const Todo& todo, const std::string& json)
+    {
+        if (!replace(todo, json))
+            place(todo);
+    }
+
+    // a completed-only patch flips one bit, the description stays in the arena
+    template <typename F>
+    bool patch(uint todoId, const TodoFields& fields, F&& f)
+    {
+        auto pos = m_index.find(todoId);
+        if (pos == DenseIndex::kNone)
+            return false;
+        Todo todo = row(pos);
+        applyFields(todo, fields);
+        assign(pos, todo);
+        f(todo, toJsonString(todo));
+        return true;
+    }
+
+    std::optional<StoredTodo> take(uint todoId)
+    {
+        auto pos = m_index.find(todoId);
+        if (pos == DenseIndex::kNone)
+            return std::nullopt;
+
+        Todo removed = row(pos);
+        m_garbage += m_lengths[pos];
+        m_lengths[pos] = 0;
+        setBit(m_live, pos, false);
+        setBit(m_completed, pos, false);
+        m_index.clear(todoId);
+        m_free.push_back(pos);
+
+        if (m_free.size() > kCompactMin && m_free.size() > size())
+            compact();
+        auto json = toJsonString(removed);
+        return StoredTodo{std::move(removed), std::move(json)};
+    }
+
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        for (std::size_t w = 0; w < m_live.size(); ++w)
+            visit(m_live[w], w, f);
+    }
+
+    template <typename F>
+    void forEachEntry(F&& f) const
+    {
+        forEach([&f](const Todo& todo)
+                { f(todo, toJsonString(todo)); });
+    }
+
+    template <typename F>
+    void forEachWhere(bool completed, F&& f) const
+    {
+        for (std::size_t w = 0; w < m_live.size(); ++w)
+            visit(m_live[w] & (completed ? m_completed[w] : ~m_completed[w]), w, f);
+    }
+
+    [[nodiscard]] std::size_t countCompleted() const noexcept
+    {
+        std::size_t n = 0;
+        for (auto word : m_completed)
+            n += std::popcount(word);
+        return n;
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return m_ids.size() - m_free.size();
+    }
+
+private:
+    static constexpr std::size_t kCompactMin = 1024;
+
+    static void setBit(std::vector<uint64_t>& bits, std::size_t pos, bool value) noexcept
+    {
+        if (value)
+            bits[pos / 64] |= uint64_t{1} << (pos % 64);
+        else
+            bits[pos / 64] &= ~(uint64_t{1} << (pos % 64));
+    }
+
+    static bool bit(const std::vector<uint64_t>& bits, std::size_t pos) noexcept
+    {
+        return (bits[pos / 64] >> (pos % 64)) & 1;
+    }
+
+    template <typename F>
+    void visit(uint64_t word, std::size_t w, F& f) const
+    {
+        while (word)
+        {
+            auto pos = w * 64 + std::countr_zero(word);
+            f(row(pos));
+            word &= word - 1;
+        }
+    }
+
+    Todo row(std::size_t pos) const
+    {
+        return Todo{m_ids[pos], m_arena.substr(m_offsets[pos], m_lengths[pos]), bit(m_completed, pos)};
+    }
+
+    void assign(uint32_t pos, const Todo& todo)
+    {
+        setBit(m_completed, pos, todo.completed);
+        // toggling `completed` leaves the text where it is
+        if (std::string_view(m_arena).substr(m_offsets[pos], m_lengths[pos]) == todo.description)
+            return;
+        m_garbage += m_lengths[pos];
+        m_offsets[pos] = append(todo.description);
+        m_lengths[pos] = static_cast<uint32_t>(todo.description.size());
+        if (m_garbage > kCompactMin && m_garbage > m_arena.size() / 2)
+            compact();
+    }
+
+    void place(const Todo& todo)
+    {
+        uint32_t pos;
+        if (m_free.empty())
+        {
+            pos = static_cast<uint32_t>(m_ids.size());
+            m_ids.push_back(todo.id);
+            m_offsets.push_back(0);
+            m_lengths.push_back(0);
+            if (pos % 64 == 0)
+            {
+                m_live.push_back(0);
+                m_completed.push_back(0);
+            }
+        }
+        else
+        {
+            pos = m_free.back();
+            m_free.pop_back();
+            m_ids[pos] = todo.id;
+        }
+        setBit(m_live, pos, true);
+        m_lengths[pos] = 0;
+        m_index.set(todo.id, pos);
+        assign(pos, todo);
+    }
+
+    uint32_t append(const std::string& text)
+    {
+        if (m_arena.size() + text.size() > UINT32_MAX)
+            throw std::length_error("ColumnarSlots: description arena exceeds 4 GiB");
+        auto offset = static_cast<uint32_t>(m_arena.size());
+        m_arena.append(text);
+        return offset;
+    }
+
+    // moves live rows to the front and rewrites the arena with live descriptions only
+    void compact()
+    {
+        std::string arena;
+        arena.reserve(m_arena.size() - m_garbage);
+        std::size_t next = 0;
+        for (std::size_t pos = 0; pos < m_ids.size(); ++pos)
+        {
+            if (!bit(m_live, pos))
+                continue;
+            auto offset = static_cast<uint32_t>(arena.size());
+            arena.append(m_arena, m_offsets[pos], m_lengths[pos]);
+            bool completed = bit(m_completed, pos);
+            m_ids[next] = m_ids[pos];
+            m_offsets[next] = offset;
+            m_lengths[next] = m_lengths[pos];
+            setBit(m_completed, pos, false);
+            setBit(m_completed, next, completed);
+            if (pos != next)
+                m_index.set(m_ids[next], static_cast<uint32_t>(next));
+            ++next;
+        }
+
+        m_ids.resize(next);
+        m_offsets.resize(next);
+        m_lengths.resize(next);
+        auto words = (next + 63) / 64;
+        m_live.assign(words, ~uint64_t{0});
+        if (next % 64)
+            m_live.back() = (uint64_t{1} << (next % 64)) - 1;
+        m_completed.resize(words);
+        m_free.clear();
+        m_arena = std::move(arena);
+        m_garbage = 0;
+    }
+
+    DenseIndex m_index;
+    std::vector<uint> m_ids;
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint32_t> m_lengths;
+    std::vector<uint64_t> m_live;
+    std::vector<uint64_t> m_completed;
+    std::vector<uint32_t> m_free;
+    std::string m_arena;
+    std::size_t m_garbage = 0;  // arena bytes no longer referenced
+};
+
+// ================================================================================================
+// ShardedStore
+// ================================================================================================
+
+// Todos split across a power-of-two number of shards keyed by `id & mask`, each guarded by its own
+// lock, so requests touching different todos no longer serialize on a single mutex.
+template <typename Slots>
+class ShardedStore : public TodoStore
+{
+public:
+    explicit ShardedStore(std::size_t shard_count = 64)
+        : m_mask(std::bit_ceil(shard_count == 0 ? 1 : shard_count) - 1),
+          m_shards(std::make_unique<Shard[]>(m_mask + 1))
+    {
+        auto shift = static_cast<unsigned>(std::countr_zero(m_mask + 1));
+        for (std::size_t i = 0; i <= m_mask; ++i)
+        {
+            m_shards[i].slots.configure(shift);
+            m_shards[i].view.shift = shift;
+            m_shards[i].published.store(std::make_shared<const TodoView>(m_shards[i].view));
+        }
+    }
+
+    [[nodiscard]] std::size_t shardCount() const noexcept
+    {
+        return m_mask + 1;
+    }
+
+    std::optional<Todo> find(uint todoId) const override
+    {
+        const auto& shard = shardOf(todoId);
+        std::shared_lock lock(shard.mutex);
+        return shard.slots.get(todoId);
+    }
+
+    std::optional<std::string> findJson(uint todoId) const override
+    {
+        const auto& shard = shardOf(todoId);
+        std::shared_lock lock(shard.mutex);
+        return shard.slots.getJson(todoId);
+    }
+
+    // JSON is rendered before the shard is locked
+    bool insert(const Todo& todo, const TodoHook& hook = nullptr) override
+    {
+        auto json = toJsonString(todo);
+        auto& shard = shardOf(todo.id);
+        std::unique_lock lock(shard.mutex);
+        if (!shard.slots.add(todo, json))
+            return false;
+        TodoViewEdit edit(shard.view);
+        this->stored(edit, todo, json, hook);
+        this->publish(shard, edit);
+        return true;
+    }
+
+    bool update(const Todo& todo, const TodoHook& hook = nullptr) override
+    {
+        auto json = toJsonString(todo);
+        auto& shard = shardOf(todo.id);
+        std::unique_lock lock(shard.mutex);
+        if (!shard.slots.replace(todo, json))
+            return false;
+        TodoViewEdit edit(shard.view);
+        this->stored(edit, todo, json, hook);
+        this->publish(shard, edit);
+        return true;
+    }
+
+    void upsert(const Todo& todo, const TodoHook& hook = nullptr) override
+    {
+        auto json = toJsonString(todo);
+        auto& shard = shardOf(todo.id);
+        std::unique_lock lock(shard.mutex);
+        shard.slots.put(todo, json);
+        TodoViewEdit edit(shard.view);
+        this->stored(edit, todo, json, hook);
+        this->publish(shard, edit);
+    }
+
+    std::optional<Todo> erase(uint todoId, const TodoHook& hook = nullptr) override
+    {
+        auto& shard = shardOf(todoId);
+        std::unique_lock lock(shard.mutex);
+        auto removed = shard.slots.take(todoId);
+        if (!removed)
+            return std::nullopt;
+        TodoViewEdit edit(shard.view);
+        this->erased(edit, removed->todo, removed->json, hook);
+        this->publish(shard, edit);
+        return std::move(removed->todo);
+    }
+
+    // patched in place; the merged JSON is rendered under the lock since it depends on the
+    // stored fields
+    bool patch(uint todoId, const TodoFields& fields, const TodoHook& hook = nullptr) override
+    {
+        auto& shard = shardOf(todoId);
+        std::unique_lock lock(shard.mutex);
+        TodoViewEdit edit(shard.view);
+        if (!shard.slots.patch(todoId, fields, [&](const Todo& todo, std::string_view json)
+                               { this->stored(edit, todo, json, hook); }))
+            return false;
+        this->publish(shard, edit);
+        return true;
+    }
+
+    // batches lock every shard they touch exactly once
+    std::size_t insertMany(const std::vector<Todo>& todos, const TodoHook& hook = nullptr) override
+    {
+        auto jsons = renderAll(todos);
+        return this->applyGrouped(
+            todos.size(), [&](std::size_t i)
+            { return todos[i].id; },
+            [&](Slots& slots, TodoViewEdit& edit, std::size_t i)
+            {
+                if (!slots.add(todos[i], jsons[i]))
+                    return false;
+                this->stored(edit, todos[i], jsons[i], hook);
+                return true;
+            });
+    }
+
+    std::size_t updateMany(const std::vector<Todo>& todos, const TodoHook& hook = nullptr) override
+    {
+        auto jsons = renderAll(todos);
+        return this->applyGrouped(
+            todos.size(), [&](std::size_t i)
+            { return todos[i].id; },
+            [&](Slots& slots, TodoViewEdit& edit, std::size_t i)
+            {
+                if (!slots.replace(todos[i], jsons[i]))
+                    return false;
+                this->stored(edit, todos[i], jsons[i], hook);
+                return true;
+            });
+    }
+
+    std::size_t upsertMany(const std::vector<Todo>& todos, const TodoHook& hook = nullptr) override
+    {
+        auto jsons = renderAll(todos);
+        return this->applyGrouped(
+            todos.size(), [&](std::size_t i)
+            { return todos[i].id; },
+            [&](Slots& slots, TodoViewEdit& edit, std::size_t i)
+            {
+                slots.put(todos[i], jsons[i]);
+                this->stored(edit, todos[i], jsons[i], hook);
+                return true;
+            });
+    }
+
+    std::size_t eraseMany(const std::vector<uint>& todoIds, const TodoHook& hook = nullptr) override
+    {
+        return this->applyGrouped(
+            todoIds.size(), [&](std::size_t i)
+            { return todoIds[i]; },
+            [&](Slots& slots, TodoViewEdit& edit, std::size_t i)
+            {
+                auto removed = slots.take(todoIds[i]);
+                if (!removed)
+                    return false;
+                this->erased(edit, removed->todo, removed->json, hook);
+                return true;
+            });
+    }
+
+    // holds one shard's shared lock at a time
+    void forEach(const std::function<void(const Todo&)>& f) const override
+    {
+        for (std::size_t i = 0; i <= m_mask; ++i)
+        {
+            std::shared_lock lock(m_shards[i].mutex);
+            m_shards[i].slots.forEach(f);
+        }
+    }
+
+    void forEachEntry(const std::function<void(const Todo&, std::string_view json)>& f) const override
+    {
+        for (std::size_t i = 0; i <= m_mask; ++i)
+        {
+            std::shared_lock lock(m_shards[i].mutex);
+            m_shards[i].slots.forEachEntry(f);
+        }
+    }
+
+    std::size_t size() const override
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i <= m_mask; ++i)
+        {
+            std::shared_lock lock(m_shards[i].mutex);
+            n += m_shards[i].slots.size();
+        }
+        return n;
+    }
+
+    // slot layouts with a native scan (see ColumnarSlots) replace the generic visit-and-test
+    void forEachWhere(bool completed, const std::function<void(const Todo&)>& f) const override
+    {
+        if constexpr (requires(const Slots& slots) { slots.forEachWhere(completed, f); })
+        {
+            for (std::size_t i = 0; i <= m_mask; ++i)
+            {
+                std::shared_lock lock(m_shards[i].mutex);
+                m_shards[i].slots.forEachWhere(completed, f);
+            }
+        }
+        else
+            TodoStore::forEachWhere(completed, f);
+    }
+
+    std::size_t countCompleted() const override
+    {
+        if constexpr (requires(const Slots& slots) { slots.countCompleted(); })
+        {
+            std::size_t n = 0;
+            for (std::size_t i = 0; i <= m_mask; ++i)
+            {
+                std::shared_lock lock(m_shards[i].mutex);
+                n += m_shards[i].slots.countCompleted();
+            }
+            return n;
+        }
+        else
+            return TodoStore::countCompleted();
+    }
+
+protected:
+    void loadViews(std::vector<TodoViewPtr>& views) const override
+    {
+        views.reserve(views.size() + m_mask + 1);
+        for (std::size_t i = 0; i <= m_mask; ++i)
+            views.push_back(m_shards[i].published.load(std::memory_order_acquire));
+    }
+
+private:
+    // one cache line per shard header so neighbouring locks do not false-share
+    struct alignas(64) Shard
+    {
+        mutable TodoMutex mutex;
+        Slots slots;
+        TodoView view;  // what readers see, changed under the unique lock
+        std::atomic<TodoViewPtr> published;  // `view` as handed to readers
+    };
+
+    // record a mutation in the shard's next view, then run the hook, all under the shard lock
+    void stored(TodoViewEdit& edit, const Todo& todo, std::string_view json, const TodoHook& hook)
+    {
+        edit.put(todo);
+        if (hook)
+            hook(todo, json);
+    }
+
+    void erased(TodoViewEdit& edit, const Todo& todo, std::string_view json, const TodoHook& hook)
+    {
+        edit.erase(todo.id);
+        if (hook)
+            hook(todo, json);
+    }
+
+    void publish(Shard& shard, TodoViewEdit& edit)
+    {
+        shard.published.store(edit.publish(), std::memory_order_release);
+        shard.view = edit.view();
+        this->bumpVersion();
+    }
+
+    static std::vector<std::string> renderAll(const std::vector<Todo>& todos)
+    {
+        std::vector<std::string> jsons;
+        jsons.reserve(todos.size());
+        for (const auto& todo : todos)
+            jsons.push_back(toJsonString(todo));
+        return jsons;
+    }
+
+    // Buckets batch positions by shard (stable, so repeated ids keep their order), then runs
+    // `apply(slots, edit, i)` for each bucket under a single acquisition of its shard lock, and
+    // publishes the shard's view once per bucket. Every touched shard is locked, in shard order,
+    // before the first todo is applied and stays locked until the last, so a batch is one step
+    // against any other write to those shards and hooks can number it as such.
+    template <typename IdOf, typename Apply>
+    std::size_t applyGrouped(std::size_t count, IdOf idOf, Apply apply)
+    {
+        std::vector<std::size_t> starts(m_mask + 2, 0);
+        for (std::size_t i = 0; i < count; ++i)
+            ++starts[(idOf(i) & m_mask) + 1];
+        for (std::size_t s = 1; s < starts.size(); ++s)
+            starts[s] += starts[s - 1];
+
+        std::vector<std::size_t> order(count);
+        auto fill = starts;
+        for (std::size_t i = 0; i < count; ++i)
+            order[fill[idOf(i) & m_mask]++] = i;
+
+        std::vector<std::unique_lock<TodoMutex>> locks;
+        for (std::size_t s = 0; s <= m_mask; ++s)
+            if (starts[s] != starts[s + 1])
+                locks.emplace_back(m_shards[s].mutex);
+
+        std::size_t n = 0;
+        for (std::size_t s = 0; s <= m_mask; ++s)
+        {
+            if (starts[s] == starts[s + 1])
+                continue;
+            TodoViewEdit edit(m_shards[s].view);
+            std::size_t applied = 0;
+            for (auto k = starts[s]; k < starts[s + 1]; ++k)
+                applied += apply(m_shards[s].slots, edit, order[k]);
+            if (applied > 0)
+                this->publish(m_shards[s], edit);
+            n += applied;
+        }
+        return n;
+    }
+
+    Shard& shardOf(uint todoId) noexcept
+    {
+        return m_shards[todoId & m_mask];
+    }
+
+    const Shard& shardOf(uint todoId) const noexcept
+    {
+        return m_shards[todoId & m_mask];
+    }
+
+    std::size_t m_mask;
+    std::unique_ptr<Shard[]> m_shards;
+};
+
+using ShardedTodos = ShardedStore<HashSlots>;
+using SlotTodos = ShardedStore<DenseSlots>;
+using ColumnarTodos = ShardedStore<ColumnarSlots>;
+
+// `--store hash|slots|columnar`
+inline std::shared_ptr<TodoStore> makeTodoStore(std::string_view kind, std::size_t shard_count)
+{
+    if (kind == "hash")
+        return std::make_shared<ShardedTodos>(shard_count);
+    if (kind == "slots")
+        return std::make_shared<SlotTodos>(shard_count);
+    if (kind == "columnar")
+        return std::make_shared<ColumnarTodos>(shard_count);
+    throw std::invalid_argument("unknown todo store: " + std::string(kind));
+}
+
+// ================================================================================================
+// IdAllocator
+// ================================================================================================
+
+// Monotonic todo id source, seeded once from the recovered store, so creating a todo no longer
+// scans the map and concurrent creates can never be handed the same id.
+class IdAllocator
+{
+public:
+    explicit IdAllocator(uint last_id = 0) noexcept
+        : m_next(last_id + 1)
+    {
+    }
+
+    // disallow copy
+    IdAllocator(const IdAllocator&) = delete;
+    IdAllocator& operator=(const IdAllocator&) = delete;
+
+    uint next() noexcept
+    {
+        return m_next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // reserves `count` consecutive ids and returns the first one
+    uint reserve(uint count) noexcept
+    {
+        return m_next.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // largest id a client may choose, one above it must still fit the allocator
+    static constexpr uint kMaxId = std::numeric_limits<uint>::max() - 1;
+
+    static bool valid(uint todoId) noexcept
+    {
+        return todoId <= kMaxId;
+    }
+
+    // Keeps later ids above an id that was chosen by the client (e.g. PUT on an unknown id). Call
+    // it before the write so a concurrent create is already handed a later id. Ids above `kMaxId`
+    // must be rejected by the caller, they saturate here instead of wrapping to 0.
+    void observe(uint todoId) noexcept
+    {
+        uint bound = std::min(todoId, kMaxId) + 1;
+        uint next = m_next.load(std::memory_order_relaxed);
+        while (next < bound && !m_next.compare_exchange_weak(next, bound, std::memory_order_relaxed))
+        {
+        }
+    }
+
+private:
+    alignas(64) std::atomic<uint> m_next;
+};
+
+using Todos = std::shared_ptr<TodoStore>;
+using Apps = std::shared_ptr<std::unordered_map<uint, uWS::App>>;
+
 struct WsData
 {
     std::string_view user_secure_token;
+    WireFormat format = WireFormat::Json;  // encoding of the todo events this client receives
 };
 
 #endif  //!__ADT__H__
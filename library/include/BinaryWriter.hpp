@@ -0,0 +1,156 @@
+/**
+ * @file:	BinaryWriter.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/16 15:12:40 Monday
+ * @brief:	MessagePack and CBOR encoders writing straight into a reusable buffer
+ **/
+
+#ifndef __BINARYWRITER__H__
+#define __BINARYWRITER__H__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// payload encodings a client can negotiate
+enum class WireFormat : uint8_t
+{
+    Json,
+    MsgPack,
+    Cbor,
+};
+
+// ================================================================================================
+// BinaryWriter
+// ================================================================================================
+#pragma region BinaryWriter
+
+// Binary counterpart of JsonWriter: appends MessagePack or CBOR tokens to a caller-owned
+// std::string. Every length and integer takes the shortest encoding, so the output matches
+// nlohmann's to_msgpack()/to_cbor() for the same values. Containers are announced by their size.
+class BinaryWriter
+{
+public:
+    BinaryWriter(std::string& out, WireFormat format) noexcept
+        : m_out(out), m_cbor(format == WireFormat::Cbor)
+    {
+    }
+
+    BinaryWriter& map(uint32_t size)
+    {
+        if (m_cbor)
+            head(5, size);
+        else if (size < 16)
+            m_out.push_back(static_cast<char>(0x80 | size));
+        else
+            sized(0xde, 0xdf, size);
+        return *this;
+    }
+
+    BinaryWriter& array(uint32_t size)
+    {
+        if (m_cbor)
+            head(4, size);
+        else if (size < 16)
+            m_out.push_back(static_cast<char>(0x90 | size));
+        else
+            sized(0xdc, 0xdd, size);
+        return *this;
+    }
+
+    BinaryWriter& string(std::string_view text)
+    {
+        auto size = static_cast<uint32_t>(text.size());
+        if (m_cbor)
+            head(3, size);
+        else if (size < 32)
+            m_out.push_back(static_cast<char>(0xa0 | size));
+        else if (size <= 0xff)
+        {
+            m_out.push_back(static_cast<char>(0xd9));
+            m_out.push_back(static_cast<char>(size));
+        }
+        else
+            sized(0xda, 0xdb, size);
+        m_out.append(text);
+        return *this;
+    }
+
+    BinaryWriter& number(uint64_t value)
+    {
+        if (m_cbor)
+            head(0, value);
+        else if (value < 128)
+            m_out.push_back(static_cast<char>(value));
+        else if (value <= 0xff)
+        {
+            m_out.push_back(static_cast<char>(0xcc));
+            m_out.push_back(static_cast<char>(value));
+        }
+        else if (value <= 0xffff)
+            bigEndian(0xcd, value, 2);
+        else if (value <= 0xffffffff)
+            bigEndian(0xce, value, 4);
+        else
+            bigEndian(0xcf, value, 8);
+        return *this;
+    }
+
+    BinaryWriter& boolean(bool value)
+    {
+        if (m_cbor)
+            m_out.push_back(static_cast<char>(value ? 0xf5 : 0xf4));
+        else
+            m_out.push_back(static_cast<char>(value ? 0xc3 : 0xc2));
+        return *this;
+    }
+
+    BinaryWriter& nil()
+    {
+        m_out.push_back(static_cast<char>(m_cbor ? 0xf6 : 0xc0));
+        return *this;
+    }
+
+private:
+    // CBOR initial byte: major type in the top 3 bits, then the argument inline or in 1/2/4/8 bytes
+    void head(uint8_t major, uint64_t value)
+    {
+        uint8_t type = static_cast<uint8_t>(major << 5);
+        if (value < 24)
+            m_out.push_back(static_cast<char>(type | value));
+        else if (value <= 0xff)
+        {
+            m_out.push_back(static_cast<char>(type | 24));
+            m_out.push_back(static_cast<char>(value));
+        }
+        else if (value <= 0xffff)
+            bigEndian(type | 25, value, 2);
+        else if (value <= 0xffffffff)
+            bigEndian(type | 26, value, 4);
+        else
+            bigEndian(type | 27, value, 8);
+    }
+
+    // MessagePack 16/32-bit length forms
+    void sized(uint8_t marker16, uint8_t marker32, uint32_t size)
+    {
+        if (size <= 0xffff)
+            bigEndian(marker16, size, 2);
+        else
+            bigEndian(marker32, size, 4);
+    }
+
+    void bigEndian(uint8_t marker, uint64_t value, int bytes)
+    {
+        m_out.push_back(static_cast<char>(marker));
+        for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8)
+            m_out.push_back(static_cast<char>(value >> shift));
+    }
+
+    std::string& m_out;
+    bool m_cbor;
+};
+
+#pragma endregion BinaryWriter
+
+#endif  //!__BINARYWRITER__H__
@@ -0,0 +1,357 @@
+/**
+ * @file:	Broadcast.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/18 09:37:14 Wednesday
+ * @brief:	cross-loop publishing through lock-free per-loop event queues
+ **/
+
+#ifndef __BROADCAST__H__
+#define __BROADCAST__H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "uWebSockets/App.h"
+
+#include "JsonWriter.hpp"
+
+// ================================================================================================
+// MpscQueue
+// ================================================================================================
+#pragma region MpscQueue
+
+// Unbounded multi-producer single-consumer queue. Producers push onto a lock-free stack with one
+// CAS, the consumer takes the whole stack with one exchange and restores the push order, so no
+// node is ever popped concurrently and there is no ABA to guard against.
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() = default;
+
+    // disallow copy
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    ~MpscQueue()
+    {
+        drain([](T&&) {});
+    }
+
+    // true when the queue was empty, i.e. the consumer has to be woken up
+    bool push(T value)
+    {
+        auto node = new Node{std::move(value), nullptr};
+        auto head = this->m_head.load(std::memory_order_relaxed);
+        do
+            node->next = head;
+        while (!this->m_head.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        return head == nullptr;
+    }
+
+    // consumer side: hands every queued value to `f` in push order, returns how many
+    template <typename F>
+    std::size_t drain(F&& f)
+    {
+        Node* stack = this->m_head.exchange(nullptr, std::memory_order_acquire);
+        Node* list = nullptr;
+        while (stack)
+        {
+            auto next = stack->next;
+            stack->next = list;
+            list = stack;
+            stack = next;
+        }
+
+        std::size_t n = 0;
+        while (list)
+        {
+            std::unique_ptr<Node> node(list);
+            list = node->next;
+            f(std::move(node->value));
+            ++n;
+        }
+        return n;
+    }
+
+private:
+    struct Node
+    {
+        T value;
+        Node* next;
+    };
+
+    std::atomic<Node*> m_head{nullptr};
+};
+
+#pragma endregion MpscQueue
+
+// ================================================================================================
+// Broadcaster
+// ================================================================================================
+#pragma region Broadcaster
+
+// One published message, immutable once built and shared by every loop it is handed to. uWS takes
+// payloads only, so the WebSocket header (and deflate) is still added per subscriber by publish.
+struct BroadcastEvent
+{
+    std::string topic;
+    std::string message;
+    uWS::OpCode opCode = uWS::OpCode::TEXT;
+    bool compress = false;
+};
+
+using BroadcastEventPtr = std::shared_ptr<const BroadcastEvent>;
+
+// Coalescing of one topic: its text events are held for `window` (zero: until the end of the loop
+// wakeup that received them) and published as one JSON array of the original messages, at most
+// `maxBatch` to a frame. Frames from `compressFrom` bytes ask for permessage-deflate.
+struct CoalescePolicy
+{
+    std::chrono::milliseconds window{0};
+    std::size_t maxBatch = 256;
+    std::size_t compressFrom = 1024;
+};
+
+// What happens to a socket whose unsent bytes pass the limit of its BackpressurePolicy
+enum class SlowConsumer : uint8_t
+{
+    DropOldest,
+    Resync,
+    Disconnect,
+};
+
+// Per-socket limit of unsent bytes. Past it a slow consumer is closed (Disconnect), or taken off its
+// topics until it has drained to half the limit, then sent the latest `keepLatest` mutation events
+// it missed (DropOldest) or a snapshot of the whole list (Resync). uWS drops what would go past
+// twice the limit, so no socket buffers more than that.
+struct BackpressurePolicy
+{
+    unsigned int limit = 1024 * 1024;
+    SlowConsumer policy = SlowConsumer::Resync;
+    std::size_t keepLatest = 64;
+};
+
+// Queue depth of one topic: its sockets, the bytes not yet sent to them, and how many of them are
+// held back as slow consumers
+struct TopicDepth
+{
+    std::size_t sockets = 0;
+    std::size_t buffered = 0;
+    std::size_t lagging = 0;
+};
+
+// Publishes to the subscribers of every attached loop from any thread. An event is allocated once
+// and queued by reference on each loop; a loop is woken only when its queue goes from empty to
+// non-empty, and then publishes everything queued since in that single wakeup. Topics with a
+// CoalescePolicy have their events merged into batched frames on the way out.
+template <bool SSL>
+class Broadcaster
+{
+public:
+    Broadcaster()
+        : m_channels(std::make_shared<const Channels>())
+    {
+    }
+
+    // disallow copy
+    Broadcaster(const Broadcaster&) = delete;
+    Broadcaster& operator=(const Broadcaster&) = delete;
+
+    // Call before the first attach; loops read the policies without locking.
+    void coalesce(std::string topic, CoalescePolicy policy)
+    {
+        this->m_policies.insert_or_assign(std::move(topic), policy);
+    }
+
+    // Call on the loop's own thread, before it runs. The channel list is copied on write, so
+    // publishers never wait for an attach. `published` runs on the loop after each wakeup or
+    // coalescing window that published, e.g. to look at the backpressure it caused.
+    void attach(uWS::TemplatedApp<SSL>& app, std::function<void()> published = nullptr)
+    {
+        auto channel = std::make_shared<Channel>(app, uWS::Loop::get(), this->m_policies, std::move(published));
+        std::lock_guard lock(this->m_attach_mutex);
+        auto channels = std::make_shared<Channels>(*this->m_channels.load(std::memory_order_acquire));
+        channels->push_back(std::move(channel));
+        this->m_channels.store(std::move(channels), std::memory_order_release);
+    }
+
+    void publish(BroadcastEventPtr event)
+    {
+        auto channels = this->m_channels.load(std::memory_order_acquire);
+        for (const auto& channel : *channels)
+            channel->post(event);
+    }
+
+    void publish(std::string topic, std::string message, uWS::OpCode opCode = uWS::OpCode::TEXT, bool compress = false)
+    {
+        this->publish(std::make_shared<const BroadcastEvent>(BroadcastEvent{std::move(topic), std::move(message), opCode, compress}));
+    }
+
+private:
+    // The queue of one loop and what it publishes to. Everything but `post` runs on the loop.
+    class Channel
+    {
+    public:
+        Channel(uWS::TemplatedApp<SSL>& app, uWS::Loop* loop, const std::unordered_map<std::string, CoalescePolicy>& policies, std::function<void()> published)
+            : m_app(app), m_loop(loop), m_published(std::move(published))
+        {
+            for (const auto& [topic, policy] : policies)
+            {
+                auto& batch = this->m_batches[topic];
+                batch.channel = this;
+                batch.policy = policy;
+                if (policy.window.count() > 0)
+                {
+                    // lives as long as the loop; its extension points back at the batch
+                    batch.timer = us_create_timer(reinterpret_cast<us_loop_t*>(loop), 0, sizeof(Batch*));
+                    auto self = &batch;
+                    std::memcpy(us_timer_ext(batch.timer), &self, sizeof(self));
+                }
+            }
+        }
+
+        void post(BroadcastEventPtr event)
+        {
+            if (this->m_queue.push(std::move(event)))
+                this->m_loop->defer([this]()
+                                    { this->drain(); });
+        }
+
+    private:
+        struct Batch
+        {
+            Channel* channel = nullptr;
+            CoalescePolicy policy;
+            us_timer_t* timer = nullptr;
+            std::vector<BroadcastEventPtr> events;
+        };
+
+        void drain()
+        {
+            this->m_queue.drain([this](BroadcastEventPtr&& event)
+                                { this->dispatch(std::move(event)); });
+            // zero windows close at the end of the wakeup
+            for (auto& [topic, batch] : this->m_batches)
+                if (batch.policy.window.count() == 0)
+                    this->flush(batch);
+            if (this->m_published)
+                this->m_published();
+        }
+
+        void dispatch(BroadcastEventPtr event)
+        {
+            auto it = this->m_batches.find(event->topic);
+            if (it == this->m_batches.end() || event->opCode != uWS::OpCode::TEXT)
+            {
+                // binary events are not merged, but must not overtake the held ones
+                if (it != this->m_batches.end())
+                    this->flush(it->second);
+                this->m_app.publish(event->topic, event->message, event->opCode, event->compress);
+                return;
+            }
+
+            auto& batch = it->second;
+            // the window opens with the first held event
+            if (batch.events.empty() && batch.timer)
+                us_timer_set(batch.timer, &Channel::onTimer, static_cast<int>(batch.policy.window.count()), 0);
+            batch.events.push_back(std::move(event));
+            if (batch.events.size() >= batch.policy.maxBatch)
+                this->flush(batch);
+        }
+
+        static void onTimer(us_timer_t* timer)
+        {
+            Batch* batch;
+            std::memcpy(&batch, us_timer_ext(timer), sizeof(batch));
+            batch->channel->flush(*batch);
+            if (batch->channel->m_published)
+                batch->channel->m_published();
+        }
+
+        void flush(Batch& batch)
+        {
+            if (batch.events.empty())
+                return;
+
+            std::size_t bytes = 2;
+            for (const auto& event : batch.events)
+                bytes += event->message.size() + 3;
+            std::string frame;
+            frame.reserve(bytes);
+            JsonWriter w(frame);
+            w.raw('[');
+            for (std::size_t i = 0; i < batch.events.size(); ++i)
+            {
+                if (i > 0)
+                    w.raw(',');
+                w.string(batch.events[i]->message);
+            }
+            w.raw(']');
+
+            this->m_app.publish(batch.events.front()->topic, frame, uWS::OpCode::TEXT, frame.size() >= batch.policy.compressFrom);
+            batch.events.clear();
+        }
+
+        uWS::TemplatedApp<SSL>& m_app;
+        uWS::Loop* m_loop;
+        std::function<void()> m_published;
+        MpscQueue<BroadcastEventPtr> m_queue;
+        std::unordered_map<std::string, Batch> m_batches;  // coalesced topics, fixed after construction
+    };
+
+    using Channels = std::vector<std::shared_ptr<Channel>>;
+
+    std::unordered_map<std::string, CoalescePolicy> m_policies;
+    std::mutex m_attach_mutex;
+    std::atomic<std::shared_ptr<const Channels>> m_channels;
+};
+
+// Subscriber counts of topics over every loop, fed by the ws subscription handler, so publishers
+// can skip rendering events no socket listens to.
+class TopicInterest
+{
+public:
+    void add(std::string_view topic, int delta)
+    {
+        std::unique_lock lock(this->m_mutex);
+        auto it = this->m_counts.try_emplace(std::string(topic), 0).first;
+        it->second += delta;
+        if (it->second <= 0)
+            this->m_counts.erase(it);
+        this->m_total.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] bool any() const
+    {
+        return this->m_total.load(std::memory_order_relaxed) > 0;
+    }
+
+    [[nodiscard]] bool interested(const std::string& topic) const
+    {
+        if (!this->any())
+            return false;
+        std::shared_lock lock(this->m_mutex);
+        return this->m_counts.contains(topic);
+    }
+
+private:
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<std::string, int> m_counts;
+    std::atomic<int> m_total{0};
+};
+
+#pragma endregion Broadcaster
+
+#endif  //!__BROADCAST__H__
@@ -8,25 +8,701 @@
 #ifndef __HELPERS__H__
 #define __HELPERS__H__
 
+#include <zlib.h>
+
 #include "Adt.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <limits>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
 inline uint getMaxId(Todos todos)
 {
-    if (!todos || todos->empty())
+    if (!todos)
+    {
+        return 0;  // Return 0 if the store is null
+    }
+    return todos->maxId();
+}
+
+// Weak validator for a store version. The process start time is part of it because versions
+// restart from the recovered state after a restart.
+inline std::string makeETag(uint64_t version, WireFormat format = WireFormat::Json)
+{
+    static const auto epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch())
+                                  .count();
+    auto tag = "W/\"" + std::to_string(epoch) + "-" + std::to_string(version);
+    // every representation of a version gets its own tag
+    if (format == WireFormat::MsgPack)
+        tag += "-msgpack";
+    else if (format == WireFormat::Cbor)
+        tag += "-cbor";
+    return tag + "\"";
+}
+
+// If-None-Match matching with the weak comparison function (RFC 9110 13.1.2)
+inline bool etagMatches(std::string_view ifNoneMatch, std::string_view etag)
+{
+    auto opaque = [](std::string_view tag)
+    {
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+            tag.remove_prefix(1);
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+            tag.remove_suffix(1);
+        if (tag.starts_with("W/"))
+            tag.remove_prefix(2);
+        return tag;
+    };
+
+    while (!ifNoneMatch.empty())
+    {
+        auto comma = ifNoneMatch.find(',');
+        auto tag = opaque(ifNoneMatch.substr(0, comma));
+        if (tag == "*" || (!tag.empty() && tag == opaque(etag)))
+            return true;
+        if (comma == std::string_view::npos)
+            break;
+        ifNoneMatch.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// ================================================================================================
+// TodoListWriter
+// ================================================================================================
+
+// Renders the todos of a snapshot as an array a bounded piece at a time, optionally keeping only
+// those whose `completed` flag matches. The snapshot is immutable, so the pieces add up to one
+// consistent list however long the caller takes between them.
+class TodoListWriter
+{
+public:
+    explicit TodoListWriter(TodoSnapshotPtr snapshot, std::optional<bool> completed = std::nullopt, WireFormat format = WireFormat::Json)
+        : m_snapshot(std::move(snapshot)), m_completed(completed), m_format(format)
+    {
+        this->m_snapshot->forEachLeaf([this](const std::vector<Todo>& todos)
+                                      { if (!todos.empty()) this->m_leaves.push_back(&todos); });
+    }
+
+    // Appends to `out` until it holds at least `budget` bytes or the list is complete. Returns
+    // false once the closing bracket has been written.
+    bool next(std::string& out, std::size_t budget)
+    {
+        if (this->m_done)
+            return false;
+
+        JsonWriter w(out);
+        BinaryWriter b(out, this->m_format);
+        bool json = this->m_format == WireFormat::Json;
+        if (!this->m_open)
+        {
+            // binary arrays are announced with their length, filtered ones are counted first
+            if (json)
+                w.raw('[');
+            else if (this->m_completed)
+            {
+                uint32_t n = 0;
+                this->m_snapshot->forEach([&n, this](const Todo& todo)
+                                          { n += todo.completed == *this->m_completed; });
+                b.array(n);
+            }
+            else
+                b.array(static_cast<uint32_t>(this->m_snapshot->size()));
+            this->m_open = true;
+        }
+        while (this->m_leaf < this->m_leaves.size() && out.size() < budget)
+        {
+            const auto& leaf = *this->m_leaves[this->m_leaf];
+            const auto& todo = leaf[this->m_next];
+            if (++this->m_next == leaf.size())
+            {
+                ++this->m_leaf;
+                this->m_next = 0;
+            }
+            if (this->m_completed && todo.completed != *this->m_completed)
+                continue;
+            if (!json)
+            {
+                writeBinary(b, todo);
+                continue;
+            }
+            if (!this->m_first)
+                w.raw(',');
+            this->m_first = false;
+            writeJson(w, todo);
+        }
+        if (this->m_leaf == this->m_leaves.size())
+        {
+            if (json)
+                w.raw(']');
+            this->m_done = true;
+        }
+        return !this->m_done;
+    }
+
+    [[nodiscard]] bool done() const noexcept
+    {
+        return this->m_done;
+    }
+
+private:
+    TodoSnapshotPtr m_snapshot;
+    std::vector<const std::vector<Todo>*> m_leaves;  // non-empty leaves of the snapshot, in order
+    std::optional<bool> m_completed;
+    WireFormat m_format;
+    std::size_t m_leaf = 0;
+    std::size_t m_next = 0;
+    bool m_open = false;
+    bool m_first = true;
+    bool m_done = false;
+};
+
+// Sends `prefix` followed by the list as a chunked response. A chunk of about `chunkBytes` is
+// rendered only once uWS has taken the previous one without backpressure, otherwise streaming
+// resumes from onWritable, so a response holds at most one rendered chunk of its own whatever the
+// list size.
+template <bool SSL>
+void streamTodos(uWS::HttpResponse<SSL>* res, TodoListWriter list, std::string prefix = {}, std::size_t chunkBytes = 64 * 1024)
+{
+    struct Stream
+    {
+        uWS::HttpResponse<SSL>* res;
+        TodoListWriter list;
+        std::string chunk;
+        std::size_t chunkBytes;
+        bool aborted = false;
+
+        // false when uWS reported backpressure, onWritable then resumes
+        bool pump()
+        {
+            while (!this->aborted && !this->list.done())
+            {
+                this->list.next(this->chunk, this->chunkBytes);
+                if (this->list.done())
+                {
+                    this->res->end(this->chunk);
+                    break;
+                }
+                bool accepted = this->res->write(this->chunk);
+                this->chunk.clear();
+                if (!accepted)
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    auto stream = std::make_shared<Stream>(Stream{res, std::move(list), std::move(prefix), chunkBytes});
+    stream->chunk.reserve(chunkBytes + 1024);
+    res->onAborted([stream]()
+                   { stream->aborted = true; });
+    res->onWritable([stream](uintmax_t)
+                    { return stream->pump(); });
+    stream->pump();
+}
+
+// A list rendered in chunks, shared by every response of one store version
+struct RenderedTodos
+{
+    uint64_t version = 0;
+    std::vector<std::string> chunks;
+};
+
+using RenderedTodosPtr = std::shared_ptr<const RenderedTodos>;
+
+// lists with more todos than this (about 100 KiB of JSON) are never kept rendered
+inline constexpr std::size_t kRenderedTodosMax = 1024;
+
+// Renders the list of `snapshot` in chunks of about `chunkBytes`. The last rendering of every
+// format and filter is kept for all workers while the store version holds, so repeated polls of a
+// small list render nothing. Larger lists return nullptr and are streamed from a TodoListWriter,
+// so a big store is never held as text. Version 0 (an unversioned SPI) is never reused.
+inline RenderedTodosPtr renderTodos(const TodoSnapshotPtr& snapshot, std::optional<bool> completed, WireFormat format, std::size_t chunkBytes = 64 * 1024)
+{
+    if (snapshot->size() > kRenderedTodosMax)
+        return nullptr;
+
+    static std::array<std::atomic<RenderedTodosPtr>, 9> cache;
+    auto& slot = cache[static_cast<int>(format) * 3 + (completed ? 1 + *completed : 0)];
+    auto rendered = slot.load(std::memory_order_acquire);
+    if (rendered && rendered->version == snapshot->version && snapshot->version != 0)
+        return rendered;
+
+    auto fresh = std::make_shared<RenderedTodos>();
+    fresh->version = snapshot->version;
+    TodoListWriter list(snapshot, completed, format);
+    while (!list.done())
+    {
+        auto& chunk = fresh->chunks.emplace_back();
+        chunk.reserve(chunkBytes + 1024);
+        list.next(chunk, chunkBytes);
+    }
+    slot.store(fresh, std::memory_order_release);
+    return fresh;
+}
+
+// Sends `prefix` followed by already rendered chunks as a chunked response, with the same
+// backpressure handling as above.
+template <bool SSL>
+void streamTodos(uWS::HttpResponse<SSL>* res, RenderedTodosPtr rendered, std::string prefix = {})
+{
+    struct Stream
+    {
+        uWS::HttpResponse<SSL>* res;
+        RenderedTodosPtr rendered;
+        std::string prefix;
+        std::size_t next = 0;
+        bool aborted = false;
+
+        bool pump()
+        {
+            if (this->aborted)
+                return true;
+            if (!this->prefix.empty())
+            {
+                bool accepted = this->res->write(this->prefix);
+                this->prefix.clear();
+                if (!accepted)
+                    return false;
+            }
+            const auto& chunks = this->rendered->chunks;
+            while (this->next < chunks.size())
+            {
+                const auto& chunk = chunks[this->next++];
+                if (this->next == chunks.size())
+                {
+                    this->res->end(chunk);
+                    break;
+                }
+                if (!this->res->write(chunk))
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    auto stream = std::make_shared<Stream>(Stream{res, std::move(rendered), std::move(prefix)});
+    res->onAborted([stream]()
+                   { stream->aborted = true; });
+    res->onWritable([stream](uintmax_t)
+                    { return stream->pump(); });
+    stream->pump();
+}
+
+// ================================================================================================
+// Request bodies
+// ================================================================================================
+
+// largest request body accepted by onBody unless a route passes its own limit
+inline constexpr std::size_t kMaxBodyBytes = 4 << 20;
+
+// Body buffers of one event loop. uWS runs every loop on its own thread, so a thread_local pool
+// needs no locking; buffers keep their capacity between requests and oversized ones are dropped.
+class BodyPool
+{
+public:
+    static BodyPool& local()
     {
-        return 0;  // Return 0 if the map is empty or null
+        thread_local BodyPool pool;
+        return pool;
     }
 
-    unsigned int largestKey = 0;  // Start with the smallest integer
-    for (const auto& pair : *todos)
+    std::string acquire(std::size_t capacity)
     {
-        if (pair.first > largestKey)
+        std::string buffer;
+        if (!this->m_free.empty())
         {
-            largestKey = pair.first;
+            buffer = std::move(this->m_free.back());
+            this->m_free.pop_back();
         }
+        buffer.reserve(capacity);
+        return buffer;
+    }
+
+    void release(std::string&& buffer)
+    {
+        if (buffer.capacity() > kMaxPooledBytes || this->m_free.size() >= kMaxPooled)
+            return;
+        buffer.clear();
+        this->m_free.push_back(std::move(buffer));
     }
-    return largestKey;
+
+private:
+    static constexpr std::size_t kMaxPooled = 64;
+    static constexpr std::size_t kMaxPooledBytes = 64 * 1024;
+
+    std::vector<std::string> m_free;
+};
+
+// Collects the request body and hands it to `f(res, body)` once complete. A body that arrives in
+// one chunk is passed straight from uWS without a copy; otherwise it is gathered in a pooled
+// buffer reserved from Content-Length. Bodies over `maxBytes` are answered with 413 as soon as
+// that is known, from the header if present, and the connection is closed.
+template <bool SSL, typename F>
+void onBody(uWS::HttpResponse<SSL>* res, uWS::HttpRequest* req, F f, std::size_t maxBytes = kMaxBodyBytes)
+{
+    auto reject = [](uWS::HttpResponse<SSL>* res)
+    {
+        res->writeStatus("413 Payload Too Large")->end("Payload Too Large", true);
+    };
+
+    std::size_t length = 0;
+    auto header = req->getHeader("content-length");
+    std::from_chars(header.data(), header.data() + header.size(), length);
+    if (length > maxBytes)
+        return reject(res);
+
+    // returns its buffer to the loop's pool when uWS drops the handler, aborted or not
+    struct Body
+    {
+        std::string buffer;
+        std::size_t reserve;
+        bool pooled = false;
+        bool rejected = false;
+
+        explicit Body(std::size_t reserve)
+            : reserve(reserve)
+        {
+        }
+        Body(Body&& other) noexcept
+            : buffer(std::move(other.buffer)), reserve(other.reserve), pooled(std::exchange(other.pooled, false)), rejected(other.rejected)
+        {
+        }
+        ~Body()
+        {
+            if (this->pooled)
+                BodyPool::local().release(std::move(this->buffer));
+        }
+    };
+
+    auto onData = [res, reject, maxBytes, f = std::move(f), body = Body(length)](std::string_view data, bool last) mutable
+    {
+        if (body.rejected)
+            return;
+        // checked first: a body without Content-Length may well arrive in a single chunk
+        if (body.buffer.size() + data.size() > maxBytes)
+        {
+            body.rejected = true;
+            return reject(res);
+        }
+        if (last && body.buffer.empty())
+            return f(res, data);
+
+        if (!body.pooled)
+        {
+            body.buffer = BodyPool::local().acquire(std::max(body.reserve, data.size()));
+            body.pooled = true;
+        }
+        body.buffer.append(data.data(), data.size());
+        if (last)
+            f(res, std::string_view(body.buffer));
+    };
+    res->onData(std::move(onData));
+    // an aborted request never sees its last chunk, nothing to flag
+    res->onAborted([]() {});
+}
+
+// ================================================================================================
+// Compression
+// ================================================================================================
+
+// HTTP bodies and ws broadcasts below this are sent as they are, deflate would only add framing
+inline constexpr std::size_t kCompressMinBytes = 1024;
+
+// true when an Accept-Encoding header allows gzip, by name or `*`, with a non-zero q-value
+inline bool acceptsGzip(std::string_view acceptEncoding)
+{
+    while (!acceptEncoding.empty())
+    {
+        auto comma = acceptEncoding.find(',');
+        auto entry = acceptEncoding.substr(0, comma);
+        acceptEncoding.remove_prefix(comma == std::string_view::npos ? acceptEncoding.size() : comma + 1);
+
+        auto coding = entry.substr(0, entry.find(';'));
+        while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t'))
+            coding.remove_prefix(1);
+        while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t'))
+            coding.remove_suffix(1);
+        bool gzip = std::equal(coding.begin(), coding.end(), "gzip", "gzip" + 4, [](char a, char b)
+                               { return std::tolower(static_cast<unsigned char>(a)) == b; });
+        if (!gzip && coding != "*")
+            continue;
+
+        double q = 1;
+        if (auto param = entry.find("q="); param != std::string_view::npos && param > entry.find(';'))
+        {
+            auto value = entry.substr(param + 2);
+            std::from_chars(value.data(), value.data() + value.size(), q);
+        }
+        return q > 0;
+    }
+    return false;
+}
+
+// gzip encoder of one thread; its deflate state is reset between bodies instead of reallocated
+class GzipEncoder
+{
+public:
+    static GzipEncoder& local()
+    {
+        thread_local GzipEncoder encoder;
+        return encoder;
+    }
+
+    GzipEncoder(const GzipEncoder&) = delete;
+    GzipEncoder& operator=(const GzipEncoder&) = delete;
+
+    ~GzipEncoder()
+    {
+        ::deflateEnd(&this->m_stream);
+    }
+
+    // nullopt when the stream could not be finished, the caller then sends `data` as it is
+    std::optional<std::string> encode(std::string_view data)
+    {
+        auto bound = ::deflateBound(&this->m_stream, data.size());
+        if (bound > std::numeric_limits<uInt>::max())
+            return std::nullopt;
+        std::string out(bound, '\0');
+        this->m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        this->m_stream.avail_in = static_cast<uInt>(data.size());
+        this->m_stream.next_out = reinterpret_cast<Bytef*>(out.data());
+        this->m_stream.avail_out = static_cast<uInt>(out.size());
+        // the bound leaves room for everything, one call finishes the stream
+        bool finished = ::deflate(&this->m_stream, Z_FINISH) == Z_STREAM_END;
+        out.resize(this->m_stream.total_out);
+        ::deflateReset(&this->m_stream);
+        if (!finished)
+            return std::nullopt;
+        return out;
+    }
+
+private:
+    GzipEncoder()
+    {
+        // 15 + 16: largest window with a gzip header and trailer
+        if (::deflateInit2(&this->m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("GzipEncoder: deflateInit2 failed");
+    }
+
+    z_stream m_stream{};
+};
+
+// A whole todo list as a response body, gzipped once it is worth it
+struct TodoBody
+{
+    uint64_t version = 0;
+    bool gzipped = false;
+    std::string body;
+};
+
+// Renders and compresses `prefix` plus the list of `snapshot`. The last body of every format and
+// filter is kept per worker thread and served again while the store version holds, so repeated
+// polls compress nothing. Version 0 (an unversioned SPI) is never reused. `prefix` must not vary
+// between calls on one thread.
+inline const TodoBody& gzipTodos(const TodoSnapshotPtr& snapshot, std::optional<bool> completed, WireFormat format, std::string_view prefix = {})
+{
+    thread_local std::array<TodoBody, 9> cache;
+    auto& slot = cache[static_cast<int>(format) * 3 + (completed ? 1 + *completed : 0)];
+    if (slot.version == snapshot->version && snapshot->version != 0)
+        return slot;
+
+    std::string plain(prefix);
+    TodoListWriter(snapshot, completed, format).next(plain, SIZE_MAX);
+    slot.version = snapshot->version;
+    auto gzipped = plain.size() >= kCompressMinBytes ? GzipEncoder::local().encode(plain) : std::nullopt;
+    slot.gzipped = gzipped.has_value();
+    slot.body = gzipped ? std::move(*gzipped) : std::move(plain);
+    return slot;
+}
+
+// ================================================================================================
+// Content negotiation
+// ================================================================================================
+
+// wire format named by a media type (parameters ignored), nullopt for anything else such as */*
+inline std::optional<WireFormat> formatOf(std::string_view mediaType)
+{
+    auto end = mediaType.find(';');
+    mediaType = mediaType.substr(0, end);
+    while (!mediaType.empty() && (mediaType.front() == ' ' || mediaType.front() == '\t'))
+        mediaType.remove_prefix(1);
+    while (!mediaType.empty() && (mediaType.back() == ' ' || mediaType.back() == '\t'))
+        mediaType.remove_suffix(1);
+
+    auto is = [mediaType](std::string_view name)
+    {
+        return std::equal(mediaType.begin(), mediaType.end(), name.begin(), name.end(), [](char a, char b)
+                          { return std::tolower(static_cast<unsigned char>(a)) == b; });
+    };
+    if (is("application/json"))
+        return WireFormat::Json;
+    if (is("application/msgpack") || is("application/x-msgpack") || is("application/vnd.msgpack"))
+        return WireFormat::MsgPack;
+    if (is("application/cbor"))
+        return WireFormat::Cbor;
+    return std::nullopt;
+}
+
+// The supported format an Accept header ranks highest by q-value, earlier entries winning ties.
+// JSON unless a binary format is asked for explicitly.
+inline WireFormat acceptedFormat(std::string_view accept)
+{
+    WireFormat best = WireFormat::Json;
+    double best_q = 0;
+    while (!accept.empty())
+    {
+        auto comma = accept.find(',');
+        auto entry = accept.substr(0, comma);
+        accept.remove_prefix(comma == std::string_view::npos ? accept.size() : comma + 1);
+
+        double q = 1;
+        if (auto param = entry.find("q="); param != std::string_view::npos && param > entry.find(';'))
+        {
+            auto value = entry.substr(param + 2);
+            std::from_chars(value.data(), value.data() + value.size(), q);
+        }
+        if (auto format = formatOf(entry); format && q > best_q)
+        {
+            best = *format;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+// format of a request body by its Content-Type, JSON unless a binary type is named
+inline WireFormat bodyFormat(std::string_view contentType)
+{
+    return formatOf(contentType).value_or(WireFormat::Json);
+}
+
+inline std::string_view mimeType(WireFormat format)
+{
+    switch (format)
+    {
+        case WireFormat::MsgPack:
+            return "application/msgpack";
+        case WireFormat::Cbor:
+            return "application/cbor";
+        default:
+            return "application/json";
+    }
+}
+
+// one todo (or nil when absent) in a binary format
+inline std::string toBinaryString(const std::optional<Todo>& todo, WireFormat format)
+{
+    std::string out;
+    BinaryWriter w(out, format);
+    if (todo)
+        writeBinary(w, *todo);
+    else
+        w.nil();
+    return out;
+}
+
+// ================================================================================================
+// WebSocket RPC
+// ================================================================================================
+
+// {"id": 7, "op": "create", "todo": {"description": "..", "completed": false}}
+// {"id": 8, "op": "modify", "todo": {"id": 1, "description": "..", "completed": true}}
+// {"id": 9, "op": "delete" | "get", "todo_id": 1}
+// {"id": "a", "op": "list", "completed": true}  (filter optional)
+// The id, a number or a string, is echoed in the reply so calls can be pipelined.
+enum class RpcOp : uint8_t
+{
+    Create,
+    Modify,
+    Delete,
+    Get,
+    List,
+};
+
+struct RpcCall
+{
+    RpcOp op = RpcOp::Get;
+    TodoFields fields{};  // create/modify
+    uint todoId = 0;  // delete/get
+    std::optional<bool> completed{};  // list
+};
+
+// true for messages meant as RPC calls rather than subscription actions
+inline bool isRpc(const nlohmann::json& request)
+{
+    return request.is_object() && request.contains("op");
+}
+
+// the request id as JSON, "null" when missing or not a number or string
+inline std::string rpcId(const nlohmann::json& request)
+{
+    auto it = request.find("id");
+    if (it == request.end() || !(it->is_number() || it->is_string()))
+        return "null";
+    return it->dump();
+}
+
+// throws std::invalid_argument, or a nlohmann exception, on a malformed call
+inline RpcCall parseRpc(const nlohmann::json& request)
+{
+    if (rpcId(request) == "null")
+        throw std::invalid_argument("id must be a number or a string");
+
+    RpcCall call;
+    const auto& op = request.at("op").get_ref<const std::string&>();
+    if (op == "create" || op == "modify")
+    {
+        call.op = op == "create" ? RpcOp::Create : RpcOp::Modify;
+        call.fields = fieldsOf(request.at("todo"));
+        if (call.op == RpcOp::Create && (!call.fields.description || !call.fields.completed))
+            throw std::invalid_argument("description and completed are required");
+        if (call.op == RpcOp::Modify && !call.fields.id)
+            throw std::invalid_argument("id is required");
+    }
+    else if (op == "delete" || op == "get")
+    {
+        call.op = op == "delete" ? RpcOp::Delete : RpcOp::Get;
+        call.todoId = request.at("todo_id").get<uint>();
+    }
+    else if (op == "list")
+    {
+        call.op = RpcOp::List;
+        if (auto it = request.find("completed"); it != request.end() && !it->is_null())
+            call.completed = it->get<bool>();
+    }
+    else
+        throw std::invalid_argument("unknown op: " + op);
+    return call;
+}
+
+// {"id": <id>, "ok": true, "result": ...}, the result appended by `write(std::string&)`
+template <typename F>
+std::string rpcResult(std::string_view id, F&& write)
+{
+    std::string out;
+    JsonWriter(out).raw("{\"id\":").raw(id).raw(",\"ok\":true,\"result\":");
+    write(out);
+    out.push_back('}');
+    return out;
+}
+
+// {"id": <id>, "ok": false, "error": "..."}
+inline std::string rpcError(std::string_view id, std::string_view error)
+{
+    std::string out;
+    JsonWriter w(out);
+    w.raw("{\"id\":").raw(id).raw(",\"ok\":false,\"error\":").string(error).raw('}');
+    return out;
 }
 
 inline std::string getTid()
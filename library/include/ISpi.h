@@ -18,6 +18,52 @@ struct ISpi
     virtual bool procModifyTodo(const Todo& todo) = 0;
     virtual bool procDeleteTodo(uint todoId) = 0;
     virtual void procSubscribedMessage(std::string_view message) = 0;
+
+    // Batch forms used by the /todos/batch routes, returning how many todos were applied. The
+    // defaults loop over the single-todo methods; override them to apply a batch in one go.
+    virtual std::size_t procNewTodos(const std::vector<Todo>& todos)
+    {
+        std::size_t n = 0;
+        for (const auto& todo : todos)
+            n += procNewTodo(todo);
+        return n;
+    }
+
+    virtual std::size_t procModifyTodos(const std::vector<Todo>& todos)
+    {
+        std::size_t n = 0;
+        for (const auto& todo : todos)
+            n += procModifyTodo(todo);
+        return n;
+    }
+
+    virtual std::size_t procDeleteTodos(const std::vector<uint>& todoIds)
+    {
+        std::size_t n = 0;
+        for (auto todoId : todoIds)
+            n += procDeleteTodo(todoId);
+        return n;
+    }
+
+    // PATCH /todo/:id: changes only the fields present in `fields` and returns the patched todo,
+    // nullopt when there is no such todo. The default merges into procQueryTodo's copy and hands
+    // it to procModifyTodo; override it to patch in place.
+    virtual std::optional<Todo> procPatchTodo(uint todoId, const TodoFields& fields)
+    {
+        auto todo = procQueryTodo(todoId);
+        if (!todo)
+            return std::nullopt;
+        applyFields(*todo, fields);
+        if (!procModifyTodo(*todo))
+            return std::nullopt;
+        return todo;
+    }
+
+    // list used by GET /todos; override to hand out a shared snapshot instead of a fresh copy
+    virtual TodoSnapshotPtr procQuerySnapshot() const
+    {
+        return std::make_shared<TodoSnapshot>(TodoSnapshot{0, procQueryTodos()});
+    }
 };
 
 template <typename T>
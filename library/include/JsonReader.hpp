@@ -0,0 +1,317 @@
+/**
+ * @file:	JsonReader.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/13 10:48:36 Friday
+ * @brief:	on-demand JSON scanner for small flat request bodies
+ **/
+
+#ifndef __JSONREADER__H__
+#define __JSONREADER__H__
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "JsonWriter.hpp"
+
+// ================================================================================================
+// JsonReader
+// ================================================================================================
+#pragma region JsonReader
+
+// Cursor over a JSON text that decodes values where they lie instead of building a DOM. Every
+// method returns false on anything it does not accept, leaving the caller to fall back to a full
+// parser, which then also reports the error. Strings are validated like nlohmann's lexer
+// (no raw control characters, well-formed UTF-8, valid escapes).
+class JsonReader
+{
+public:
+    explicit JsonReader(std::string_view text) noexcept
+        : m_p(text.data()), m_end(text.data() + text.size())
+    {
+    }
+
+    void skipWhitespace() noexcept
+    {
+        while (m_p < m_end && (*m_p == ' ' || *m_p == '\n' || *m_p == '\r' || *m_p == '\t'))
+            ++m_p;
+    }
+
+    // consumes `c` after optional whitespace
+    bool consume(char c) noexcept
+    {
+        skipWhitespace();
+        if (m_p == m_end || *m_p != c)
+            return false;
+        ++m_p;
+        return true;
+    }
+
+    [[nodiscard]] bool atEnd() noexcept
+    {
+        skipWhitespace();
+        return m_p == m_end;
+    }
+
+    bool string(std::string& out)
+    {
+        out.clear();
+        if (!consume('"'))
+            return false;
+
+        while (m_p < m_end)
+        {
+            // stops at '"', '\\' and control characters; SIMD accelerated
+            auto clean = JsonWriter::cleanPrefix(std::string_view(m_p, m_end - m_p));
+            if (!validUtf8(m_p, clean))
+                return false;
+            out.append(m_p, clean);
+            m_p += clean;
+            if (m_p == m_end)
+                return false;
+
+            char c = *m_p++;
+            if (c == '"')
+                return true;
+            if (c != '\\' || !unescape(out))
+                return false;
+        }
+        return false;
+    }
+
+    // non-negative integer without sign, fraction or exponent
+    bool number(uint64_t& out) noexcept
+    {
+        skipWhitespace();
+        if (m_p == m_end || *m_p < '0' || *m_p > '9' || (*m_p == '0' && m_p + 1 < m_end && isDigit(m_p[1])))
+            return false;
+        auto [end, ec] = std::from_chars(m_p, m_end, out);
+        if (ec != std::errc() || (end < m_end && (*end == '.' || *end == 'e' || *end == 'E')))
+            return false;
+        m_p = end;
+        return true;
+    }
+
+    bool boolean(bool& out) noexcept
+    {
+        skipWhitespace();
+        if (literal("true"))
+            out = true;
+        else if (literal("false"))
+            out = false;
+        else
+            return false;
+        return true;
+    }
+
+    // skips a string, number or literal; nested objects and arrays are not handled
+    bool skipScalar()
+    {
+        skipWhitespace();
+        if (m_p == m_end)
+            return false;
+        if (*m_p == '"')
+        {
+            std::string ignored;
+            return string(ignored);
+        }
+        if (literal("null") || literal("true") || literal("false"))
+            return true;
+
+        // JSON number grammar: -?(0|[1-9]\d*)(\.\d+)?([eE][+-]?\d+)?
+        if (*m_p == '-')
+            ++m_p;
+        if (m_p == m_end || !isDigit(*m_p))
+            return false;
+        if (*m_p == '0')
+            ++m_p;
+        else
+            digits();
+        if (m_p < m_end && *m_p == '.')
+        {
+            ++m_p;
+            if (!digits())
+                return false;
+        }
+        if (m_p < m_end && (*m_p == 'e' || *m_p == 'E'))
+        {
+            ++m_p;
+            if (m_p < m_end && (*m_p == '+' || *m_p == '-'))
+                ++m_p;
+            if (!digits())
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static bool isDigit(char c) noexcept
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    bool digits() noexcept
+    {
+        auto start = m_p;
+        while (m_p < m_end && isDigit(*m_p))
+            ++m_p;
+        return m_p != start;
+    }
+
+    bool literal(std::string_view word) noexcept
+    {
+        if (std::string_view(m_p, m_end - m_p).substr(0, word.size()) != word)
+            return false;
+        m_p += word.size();
+        return true;
+    }
+
+    bool hex4(uint32_t& out) noexcept
+    {
+        if (m_end - m_p < 4)
+            return false;
+        out = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            char c = *m_p++;
+            out <<= 4;
+            if (c >= '0' && c <= '9')
+                out |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                out |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                out |= c - 'A' + 10;
+            else
+                return false;
+        }
+        return true;
+    }
+
+    bool unescape(std::string& out)
+    {
+        if (m_p == m_end)
+            return false;
+        switch (*m_p++)
+        {
+            case '"':
+                out.push_back('"');
+                return true;
+            case '\\':
+                out.push_back('\\');
+                return true;
+            case '/':
+                out.push_back('/');
+                return true;
+            case 'b':
+                out.push_back('\b');
+                return true;
+            case 'f':
+                out.push_back('\f');
+                return true;
+            case 'n':
+                out.push_back('\n');
+                return true;
+            case 'r':
+                out.push_back('\r');
+                return true;
+            case 't':
+                out.push_back('\t');
+                return true;
+            case 'u':
+                break;
+            default:
+                return false;
+        }
+
+        uint32_t cp;
+        if (!hex4(cp) || (cp >= 0xDC00 && cp <= 0xDFFF))
+            return false;
+        if (cp >= 0xD800 && cp <= 0xDBFF)
+        {
+            uint32_t low;
+            if (m_end - m_p < 2 || m_p[0] != '\\' || m_p[1] != 'u')
+                return false;
+            m_p += 2;
+            if (!hex4(low) || low < 0xDC00 || low > 0xDFFF)
+                return false;
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        }
+
+        if (cp < 0x80)
+            out.push_back(static_cast<char>(cp));
+        else if (cp < 0x800)
+        {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else if (cp < 0x10000)
+        {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else
+        {
+            out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        return true;
+    }
+
+    // a run never ends inside a sequence: the bytes that stop it are all ASCII
+    static bool validUtf8(const char* s, std::size_t n) noexcept
+    {
+        auto p = reinterpret_cast<const unsigned char*>(s);
+        auto end = p + n;
+        while (p < end)
+        {
+#if defined(__SSE2__)
+            // plain ASCII, 16 bytes per step
+            while (end - p >= 16 && _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) == 0)
+                p += 16;
+            if (p == end)
+                break;
+#endif
+            if (*p < 0x80)
+            {
+                ++p;
+                continue;
+            }
+
+            std::size_t len;
+            uint32_t min;
+            uint32_t cp;
+            if ((*p & 0xE0) == 0xC0)
+                len = 2, min = 0x80, cp = *p & 0x1F;
+            else if ((*p & 0xF0) == 0xE0)
+                len = 3, min = 0x800, cp = *p & 0x0F;
+            else if ((*p & 0xF8) == 0xF0)
+                len = 4, min = 0x10000, cp = *p & 0x07;
+            else
+                return false;
+
+            if (static_cast<std::size_t>(end - p) < len)
+                return false;
+            for (std::size_t i = 1; i < len; ++i)
+            {
+                if ((p[i] & 0xC0) != 0x80)
+                    return false;
+                cp = (cp << 6) | (p[i] & 0x3F);
+            }
+            if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+                return false;
+            p += len;
+        }
+        return true;
+    }
+
+    const char* m_p;
+    const char* m_end;
+};
+
+#pragma endregion JsonReader
+
+#endif  //!__JSONREADER__H__
@@ -0,0 +1,264 @@
+/**
+ * @file:	Snapshot.hpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/10 09:41:17 Tuesday
+ * @brief:	binary snapshots of the todo store, loaded in parallel through mmap
+ **/
+
+#ifndef __SNAPSHOT__H__
+#define __SNAPSHOT__H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Adt.h"
+#include "Wal.hpp"
+
+// ================================================================================================
+// Snapshot
+// ================================================================================================
+#pragma region Snapshot
+
+// File layout (little endian):
+//   header  = magic[8] | u32 version | u32 chunk_count | u64 todo_count | u64 wal_lsn | u64 table_offset
+//   records = u32 id | u8 completed | u32 description_len | description, grouped in chunks
+//   table   = chunk_count * (u64 offset | u64 bytes | u32 count | u32 crc32)
+//
+// Chunks are independent so recovery can verify and decode them on several threads at once.
+// `wal_lsn` is the log position the snapshot covers: only records after it need replaying.
+class Snapshot
+{
+public:
+    // Writes `todos` to `path` atomically (temp file + rename). `lsn` must be read from the Wal
+    // before calling, every record up to it is then guaranteed to be part of the snapshot. The
+    // todos are encoded from a store snapshot, so no store lock is held during file I/O.
+    static std::size_t write(const std::string& path, const TodoStore& todos, Wal::Lsn lsn)
+    {
+        auto tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Snapshot: cannot open " + tmp + ": " + std::strerror(errno));
+
+        std::string buffer(kHeaderSize, '\0');
+        std::vector<Chunk> table;
+        uint64_t offset = 0;  // file offset of `buffer[0]`
+        uint64_t todo_count = 0;
+        Chunk chunk{kHeaderSize, 0, 0, 0};
+
+        auto flush = [&]()
+        {
+            writeAll(fd, buffer.data(), buffer.size(), tmp);
+            offset += buffer.size();
+            buffer.clear();
+        };
+        auto closeChunk = [&]()
+        {
+            if (chunk.count == 0)
+                return;
+            chunk.bytes = offset + buffer.size() - chunk.offset;
+            table.push_back(chunk);
+            chunk = Chunk{offset + buffer.size(), 0, 0, 0};
+        };
+        auto encode = [&](const Todo& todo)
+        {
+            auto begin = buffer.size();
+            uint32_t len = static_cast<uint32_t>(todo.description.size());
+            char fixed[kRecordFixed];
+            std::memcpy(fixed, &todo.id, 4);
+            fixed[4] = todo.completed ? 1 : 0;
+            std::memcpy(fixed + 5, &len, 4);
+            buffer.append(fixed, kRecordFixed);
+            buffer.append(todo.description);
+            chunk.crc = ::crc32(chunk.crc, reinterpret_cast<const Bytef*>(buffer.data() + begin), buffer.size() - begin);
+
+            ++todo_count;
+            if (++chunk.count == kChunkTodos)
+                closeChunk();
+            if (buffer.size() >= kFlushBytes)
+                flush();
+        };
+        todos.snapshot()->forEach(encode);
+        closeChunk();
+
+        // chunk table, then the header pointing at it
+        uint64_t table_offset = offset + buffer.size();
+        for (const auto& c : table)
+        {
+            char entry[kTableEntry];
+            std::memcpy(entry, &c.offset, 8);
+            std::memcpy(entry + 8, &c.bytes, 8);
+            std::memcpy(entry + 16, &c.count, 4);
+            std::memcpy(entry + 20, &c.crc, 4);
+            buffer.append(entry, kTableEntry);
+        }
+        flush();
+
+        char header[kHeaderSize];
+        uint32_t version = kVersion;
+        uint32_t chunk_count = static_cast<uint32_t>(table.size());
+        std::memcpy(header, kMagic, 8);
+        std::memcpy(header + 8, &version, 4);
+        std::memcpy(header + 12, &chunk_count, 4);
+        std::memcpy(header + 16, &todo_count, 8);
+        std::memcpy(header + 24, &lsn, 8);
+        std::memcpy(header + 32, &table_offset, 8);
+        if (::pwrite(fd, header, kHeaderSize, 0) != static_cast<ssize_t>(kHeaderSize) || ::fsync(fd) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("Snapshot: cannot write " + tmp + ": " + std::strerror(errno));
+        }
+        ::close(fd);
+
+        // the rename must be durable before the log records it covers can be dropped
+        if (::rename(tmp.c_str(), path.c_str()) != 0 || !syncParentDir(path))
+            throw std::runtime_error("Snapshot: cannot rename " + tmp + ": " + std::strerror(errno));
+        return todo_count;
+    }
+
+    // Maps `path` and loads its chunks into `todos` on `threads` threads. Returns the Wal position
+    // to resume replay from, or nullopt when there is no usable snapshot.
+    static std::optional<Wal::Lsn> load(const std::string& path, TodoStore& todos, unsigned threads = std::thread::hardware_concurrency())
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return std::nullopt;
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < kHeaderSize)
+        {
+            ::close(fd);
+            std::cerr << "Snapshot: " << path << " is truncated, ignored" << std::endl;
+            return std::nullopt;
+        }
+        std::size_t size = static_cast<std::size_t>(st.st_size);
+        void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            throw std::runtime_error("Snapshot: cannot mmap " + path + ": " + std::strerror(errno));
+        ::madvise(mapped, size, MADV_WILLNEED);
+
+        const char* data = static_cast<const char*>(mapped);
+        auto lsn = loadMapped(path, data, size, todos, std::max(threads, 1u));
+        ::munmap(mapped, size);
+        return lsn;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'T', 'O', 'D', 'O', 'S', 'N', 'P', '1'};
+    static constexpr uint32_t kVersion = 1;
+    static constexpr std::size_t kHeaderSize = 40;
+    static constexpr std::size_t kRecordFixed = 9;
+    static constexpr std::size_t kTableEntry = 24;
+    static constexpr uint32_t kChunkTodos = 64 * 1024;
+    static constexpr std::size_t kFlushBytes = 1 << 20;
+
+    struct Chunk
+    {
+        uint64_t offset;
+        uint64_t bytes;
+        uint32_t count;
+        uint32_t crc;
+    };
+
+    template <typename T>
+    static T load(const char* p) noexcept
+    {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return v;
+    }
+
+    static std::optional<Wal::Lsn> loadMapped(const std::string& path, const char* data, std::size_t size, TodoStore& todos, unsigned threads)
+    {
+        auto chunk_count = load<uint32_t>(data + 12);
+        auto table_offset = load<uint64_t>(data + 32);
+        if (std::memcmp(data, kMagic, 8) != 0 || load<uint32_t>(data + 8) != kVersion ||
+            table_offset > size || (size - table_offset) / kTableEntry < chunk_count)
+        {
+            std::cerr << "Snapshot: " << path << " has a bad header, ignored" << std::endl;
+            return std::nullopt;
+        }
+
+        std::vector<Chunk> table(chunk_count);
+        for (uint32_t i = 0; i < chunk_count; ++i)
+        {
+            const char* entry = data + table_offset + i * kTableEntry;
+            table[i] = Chunk{load<uint64_t>(entry), load<uint64_t>(entry + 8), load<uint32_t>(entry + 16), load<uint32_t>(entry + 20)};
+            if (table[i].offset > table_offset || table[i].bytes > table_offset - table[i].offset)
+            {
+                std::cerr << "Snapshot: " << path << " has a bad chunk table, ignored" << std::endl;
+                return std::nullopt;
+            }
+        }
+
+        // every chunk is verified before anything is inserted, a corrupt snapshot loads nothing
+        std::vector<char> valid(chunk_count, 0);
+        auto forChunks = [&](auto&& f)
+        {
+            std::vector<std::thread> workers;
+            unsigned n = std::min<unsigned>(threads, std::max<uint32_t>(chunk_count, 1));
+            for (unsigned w = 0; w < n; ++w)
+                workers.emplace_back([&, w]()
+                                     { for (uint32_t i = w; i < chunk_count; i += n) f(i); });
+            for (auto& worker : workers)
+                worker.join();
+        };
+
+        forChunks([&](uint32_t i)
+                  { valid[i] = ::crc32(0L, reinterpret_cast<const Bytef*>(data + table[i].offset), table[i].bytes) == table[i].crc; });
+        if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+        {
+            std::cerr << "Snapshot: " << path << " failed its checksum, ignored" << std::endl;
+            return std::nullopt;
+        }
+
+        // a chunk goes in as one batch, locking and publishing each shard once
+        forChunks([&](uint32_t i)
+                  {
+                      const char* p = data + table[i].offset;
+                      std::vector<Todo> batch;
+                      batch.reserve(table[i].count);
+                      for (uint32_t k = 0; k < table[i].count; ++k)
+                      {
+                          auto len = load<uint32_t>(p + 5);
+                          batch.push_back(Todo{load<uint32_t>(p), std::string(p + kRecordFixed, len), p[4] != 0});
+                          p += kRecordFixed + len;
+                      }
+                      todos.upsertMany(batch); });
+
+        return load<uint64_t>(data + 24);
+    }
+
+    static void writeAll(int fd, const char* p, std::size_t left, const std::string& path)
+    {
+        while (left > 0)
+        {
+            auto n = ::write(fd, p, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Snapshot: cannot write " + path + ": " + std::strerror(errno));
+            }
+            p += n;
+            left -= static_cast<std::size_t>(n);
+        }
+    }
+};
+
+#pragma endregion Snapshot
+
+#endif  //!__SNAPSHOT__H__
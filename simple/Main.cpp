@@ -9,13 +9,25 @@
 #include <iostream>
 #include <random>
 
+#include "Snapshot.hpp"
 #include "TodoServer.h"
 
 void mockServer(TodoServerPtr todoServer);
+void snapshotServer(Todos todos, std::shared_ptr<Wal> wal, std::string path, int interval_secs);
 
 int main(int argc, char* argv[])
 {
     int workers = 1;  // Default workers set to 1
+    int shards = 64;  // Default todo store shards, rounded up to a power of two
+    std::string store = "hash";  // Todo storage: hash/slots/columnar
+    std::string wal_path;  // Write-ahead log, disabled when empty
+    int wal_flush_us = 1000;  // Group commit window of the write-ahead log
+    std::string snapshot_path;  // Periodic snapshot, disabled when empty
+    int snapshot_secs = 300;  // Interval between snapshots
+    int coalesce_ms = -1;  // Window merging "mutation" broadcasts, disabled when negative
+    int coalesce_max = 256;  // Most events in one merged frame
+    int changefeed = 1024;  // Mutation events kept for resuming subscribers, disabled when 0
+    BackpressurePolicy backpressure;  // Unsent bytes a ws client may have, and what happens past it
 
     // Check command-line arguments
     for (int i = 1; i < argc; ++i)
@@ -29,6 +41,89 @@ int main(int argc, char* argv[])
             workers = std::stoi(argv[i + 1]);
             ++i;  // Skip the next argument since it's already processed
         }
+        // Check for --shards argument
+        else if (arg == "--shards" && (i + 1) < argc)
+        {
+            shards = std::stoi(argv[i + 1]);
+            ++i;
+        }
+        // Check for --store argument
+        else if (arg == "--store" && (i + 1) < argc)
+        {
+            store = argv[i + 1];
+            ++i;
+        }
+        // Check for --wal argument
+        else if (arg == "--wal" && (i + 1) < argc)
+        {
+            wal_path = argv[i + 1];
+            ++i;
+        }
+        // Check for --wal-flush-us argument
+        else if (arg == "--wal-flush-us" && (i + 1) < argc)
+        {
+            wal_flush_us = std::stoi(argv[i + 1]);
+            ++i;
+        }
+        // Check for --snapshot argument
+        else if (arg == "--snapshot" && (i + 1) < argc)
+        {
+            snapshot_path = argv[i + 1];
+            ++i;
+        }
+        // Check for --snapshot-secs argument
+        else if (arg == "--snapshot-secs" && (i + 1) < argc)
+        {
+            snapshot_secs = std::stoi(argv[i + 1]);
+            ++i;
+        }
+        // Check for --coalesce-ms argument
+        else if (arg == "--coalesce-ms" && (i + 1) < argc)
+        {
+            coalesce_ms = std::stoi(argv[i + 1]);
+            ++i;
+        }
+        // Check for --coalesce-max argument
+        else if (arg == "--coalesce-max" && (i + 1) < argc)
+        {
+            coalesce_max = std::stoi(argv[i + 1]);
+            ++i;
+        }
+        // Check for --changefeed argument
+        else if (arg == "--changefeed" && (i + 1) < argc)
+        {
+            changefeed = std::stoi(argv[i + 1]);
+            ++i;
+        }
+        // Check for --ws-limit argument
+        else if (arg == "--ws-limit" && (i + 1) < argc)
+        {
+            backpressure.limit = static_cast<unsigned int>(std::stoul(argv[i + 1]));
+            ++i;
+        }
+        // Check for --slow-consumer argument
+        else if (arg == "--slow-consumer" && (i + 1) < argc)
+        {
+            std::string policy = argv[i + 1];
+            if (policy == "resync")
+                backpressure.policy = SlowConsumer::Resync;
+            else if (policy == "drop-oldest")
+                backpressure.policy = SlowConsumer::DropOldest;
+            else if (policy == "disconnect")
+                backpressure.policy = SlowConsumer::Disconnect;
+            else
+            {
+                std::cerr << "Usage: --slow-consumer resync|drop-oldest|disconnect, got " << policy << std::endl;
+                return EXIT_FAILURE;
+            }
+            ++i;
+        }
+        // Check for --keep-latest argument
+        else if (arg == "--keep-latest" && (i + 1) < argc)
+        {
+            backpressure.keepLatest = std::stoul(argv[i + 1]);
+            ++i;
+        }
     }
 
     // Output the number of workers
@@ -36,12 +131,36 @@ int main(int argc, char* argv[])
 
     try
     {
-        auto todos = std::make_shared<std::unordered_map<uint, Todo>>();
-        auto todo_mutex = std::shared_mutex();
+        auto todos = makeTodoStore(store, shards);
         auto port = 9001;
 
+        // recover from the latest snapshot plus the log tail it does not cover
+        auto recovery_start = std::chrono::steady_clock::now();
+        Wal::Lsn replay_from = 0;
+        if (!snapshot_path.empty())
+        {
+            if (auto lsn = Snapshot::load(snapshot_path, *todos))
+                replay_from = *lsn;
+            std::cout << "Loaded " << todos->size() << " todos from " << snapshot_path << std::endl;
+        }
+
+        std::shared_ptr<Wal> wal;
+        if (!wal_path.empty())
+        {
+            Wal::replay(wal_path, replay_from, *todos);
+            wal = std::make_shared<Wal>(wal_path, std::chrono::microseconds(wal_flush_us));
+        }
+
+        auto recovery_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - recovery_start);
+        std::cout << "Recovered " << todos->size() << " todos in " << recovery_ms.count() << " ms" << std::endl;
+
         // singleton
-        auto todo_server = std::make_shared<TodoServer>(TodoServer(todos, todo_mutex));
+        auto todo_server = std::make_shared<TodoServer>(todos, wal);
+        if (coalesce_ms >= 0)
+            todo_server->coalesceTopic("mutation", CoalescePolicy{std::chrono::milliseconds(coalesce_ms), static_cast<std::size_t>(std::max(coalesce_max, 1))});
+        if (changefeed > 0)
+            todo_server->enableChangefeed(static_cast<std::size_t>(changefeed));
+        todo_server->limitBackpressure(backpressure);
 
         for (uint i = 1; i <= workers; ++i)
         {
@@ -53,6 +172,13 @@ int main(int argc, char* argv[])
         // mock server thread
         std::thread mock_server_t(mockServer, todo_server);
         mock_server_t.detach();
+
+        // snapshot thread
+        if (!snapshot_path.empty())
+        {
+            std::thread snapshot_server_t(snapshotServer, todos, wal, snapshot_path, snapshot_secs);
+            snapshot_server_t.detach();
+        }
     }
     catch (const std::exception& e)
     {
@@ -95,3 +221,32 @@ void mockServer(TodoServerPtr todoServer)
         todoServer->broadcastMessage("random", "Random todo update from mock server: " + formattedTime);
     }
 }
+
+void snapshotServer(Todos todos, std::shared_ptr<Wal> wal, std::string path, int interval_secs)
+{
+    std::cout << "Starting snapshotServer..." << std::endl;
+
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(interval_secs));
+
+        try
+        {
+            // read the log position first: everything logged before it is already in the store, and
+            // only a durable position is sure to still lie on a record boundary after a crash
+            Wal::Lsn lsn = wal ? wal->durableLsn() : 0;
+            auto start = std::chrono::steady_clock::now();
+            auto count = Snapshot::write(path, *todos, lsn);
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            std::cout << "Snapshot of " << count << " todos written in " << elapsed.count() << " ms" << std::endl;
+
+            // the records it covers are no longer needed for recovery
+            if (wal)
+                wal->compact(lsn);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Snapshot failed: " << e.what() << std::endl;
+        }
+    }
+}
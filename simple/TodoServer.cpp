@@ -9,60 +9,73 @@
 
 #include <fmt/format.h>
 
+#include <cstring>
+
 #include <nlohmann/json.hpp>
 
-// JSON encoding and decoding functions for Todo
-void to_json(nlohmann::json& j, const Todo& todo)
+#include "Helpers.hpp"
+#include "Routes.hpp"
+
+// ================================================================================================
+// Server
+// ================================================================================================
+#pragma region TodoServer
+
+// binary ws clients are subscribed to a per-format twin of every topic, e.g. "mutation/msgpack"
+static std::string formatTopic(std::string_view topic, WireFormat format)
 {
-    j = nlohmann::json{
-        {"id", todo.id},
-        {"description", todo.description},
-        {"completed", todo.completed},
-    };
+    switch (format)
+    {
+        case WireFormat::MsgPack:
+            return std::string(topic) + "/msgpack";
+        case WireFormat::Cbor:
+            return std::string(topic) + "/cbor";
+        default:
+            return std::string(topic);
+    }
 }
 
-void from_json(const nlohmann::json& j, Todo& todo)
+static WireFormat topicFormat(std::string_view topic)
 {
-    j.at("id").get_to(todo.id);
-    j.at("description").get_to(todo.description);
-    j.at("completed").get_to(todo.completed);
+    if (topic.ends_with("/msgpack"))
+        return WireFormat::MsgPack;
+    if (topic.ends_with("/cbor"))
+        return WireFormat::Cbor;
+    return WireFormat::Json;
 }
 
-uint getMaxId(Todos todos)
+// topics scoped to one todo, "todo:42", or to one list, "todos:completed" / "todos:active"
+static bool isScopedTopic(std::string_view topic)
 {
-    if (!todos || todos->empty())
-    {
-        return 0;  // Return 0 if the map is empty or null
-    }
+    return topic.starts_with("todo:") || topic.starts_with("todos:");
+}
 
-    uint largestKey = 0;  // Start with the smallest integer
-    for (const auto& pair : *todos)
-    {
-        if (pair.first > largestKey)
-        {
-            largestKey = pair.first;
-        }
-    }
-    return largestKey;
+// permessage-deflate for the subscribers that negotiated it, once the payload is worth it
+static BroadcastEventPtr makeBroadcast(std::string topic, std::string message, uWS::OpCode opCode)
+{
+    bool compress = message.size() >= kCompressMinBytes;
+    return std::make_shared<const BroadcastEvent>(BroadcastEvent{std::move(topic), std::move(message), opCode, compress});
 }
 
-auto getTid()
+TodoServer::TodoServer(Todos todos, std::shared_ptr<Wal> wal)
+    : m_todos(todos), m_ids(getMaxId(todos)), m_wal(wal)
 {
-    std::stringstream ss;
-    auto tid = std::this_thread::get_id();
-    ss << tid;
-    return ss.str();
+    this->m_apps = std::make_shared<std::unordered_map<uint, uWS::App>>();
 }
 
-// ================================================================================================
-// Server
-// ================================================================================================
-#pragma region TodoServer
+void TodoServer::coalesceTopic(std::string topic, CoalescePolicy policy)
+{
+    this->m_broadcaster.coalesce(std::move(topic), policy);
+}
 
-TodoServer::TodoServer(Todos todos, TodoMutex& todo_mutex)
-    : m_todos(todos), m_mutex(todo_mutex)
+void TodoServer::enableChangefeed(std::size_t capacity)
 {
-    this->m_apps = std::make_shared<std::unordered_map<uint, uWS::App>>();
+    this->m_changefeed = std::make_unique<Changefeed<FeedEntry>>(capacity);
+}
+
+void TodoServer::limitBackpressure(BackpressurePolicy policy)
+{
+    this->m_backpressure = policy;
 }
 
 void TodoServer::startServer(uint app_num, int port)
@@ -70,6 +83,16 @@ void TodoServer::startServer(uint app_num, int port)
     std::cout << "Starting Todo server on port " << port << "..." << std::endl;
 
     this->m_apps->insert({app_num, uWS::App()});
+    // broadcasts from any thread reach this loop through its own queue, after which its sockets
+    // are checked for slow consumers
+    auto ws_loop = std::make_shared<WsLoop>(WsLoop{this, app_num});
+    this->m_broadcaster.attach(this->m_apps->at(app_num), [this, ws_loop]()
+                               { this->checkBackpressure(*ws_loop); });
+    // queue depths of this loop, sampled every second for /ws/stats
+    auto sampler = us_create_timer(reinterpret_cast<us_loop_t*>(uWS::Loop::get()), 0, sizeof(WsLoop*));
+    auto sampled = ws_loop.get();
+    std::memcpy(us_timer_ext(sampler), &sampled, sizeof(sampled));
+    us_timer_set(sampler, &TodoServer::onSample, 1000, 1000);
 
     // HTTP routes
     // ================================================================================================
@@ -77,17 +100,44 @@ void TodoServer::startServer(uint app_num, int port)
     // ================================================================================================
     auto get_all = [this](auto* res, auto* req)
     {
-        getAllTodos(res);
+        // optional filter: /todos?completed=true|false
+        std::optional<bool> completed;
+        if (auto filter = req->getQuery("completed"); filter && !filter->empty())
+            completed = *filter == "true";
+        getAllTodos(res, completed, req->getHeader("if-none-match"), acceptedFormat(req->getHeader("accept")), acceptsGzip(req->getHeader("accept-encoding")));
     };
     this->m_apps->at(app_num).get("/todos", get_all);
 
+    // ================================================================================================
+    // get_todo_stats
+    // ================================================================================================
+    auto get_stats = [this](auto* res, auto* req)
+    {
+        getTodoStats(res, acceptedFormat(req->getHeader("accept")));
+    };
+    this->m_apps->at(app_num).get("/todos/stats", get_stats);
+
+    // ================================================================================================
+    // get_ws_stats
+    // ================================================================================================
+    auto get_ws_stats = [this](auto* res, auto*)
+    {
+        getWsStats(res);
+    };
+    this->m_apps->at(app_num).get("/ws/stats", get_ws_stats);
+
     // ================================================================================================
     // get_todo
     // ================================================================================================
     auto get_todo = [this](auto* res, auto* req)
     {
-        auto todoId = std::stoi(std::string(req->getParameter(0)));
-        getTodo(res, todoId);
+        uint todoId;
+        if (!Param<uint>::parse(req->getParameter(0), todoId))
+        {
+            res->writeStatus("400 Bad Request")->end("invalid id: " + std::string(req->getParameter(0)));
+            return;
+        }
+        getTodo(res, todoId, acceptedFormat(req->getHeader("accept")));
     };
     this->m_apps->at(app_num).get("/todo/:id", get_todo);
 
@@ -96,38 +146,37 @@ void TodoServer::startServer(uint app_num, int port)
     // ================================================================================================
     auto create_todo = [this](auto* res, auto* req)
     {
-        auto isAborted = std::make_shared<bool>(false);
-        std::string buffer;
-        auto onData = [this,
-                       res,
-                       isAborted,
-                       buffer = std::move(buffer)](std::string_view data, bool last) mutable
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto accepted = acceptedFormat(req->getHeader("accept"));
+        auto handle = [this, format, accepted](auto* res, std::string_view buffer)
         {
-            buffer.append(data.data(), data.length());
-            if (last)
+            try
             {
-                try
+                // Parse body for new TODO details, nlohmann only for binary formats or when the
+                // fast JSON scan gives up
+                std::string description;
+                bool completed;
+                std::optional<TodoFields> fields;
+                if (format == WireFormat::Json && (fields = scanTodoFields(buffer)) && fields->description && fields->completed)
                 {
-                    // Parse JSON body for new TODO details
-                    nlohmann::json body = nlohmann::json::parse(buffer);
-                    std::string description = body["description"];
-                    bool completed = body["completed"];
-                    auto maxId = getMaxId(this->m_todos);
-                    auto newId = maxId + 1;
-
-                    if (!*isAborted)
-                        modifyTodo(res, newId, description, completed);
+                    description = std::move(*fields->description);
+                    completed = *fields->completed;
                 }
-                catch (const std::exception& e)
+                else
                 {
-                    res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+                    nlohmann::json body = decodeBody(buffer, format);
+                    description = body["description"];
+                    completed = body["completed"];
                 }
+                createTodo(res, description, completed, accepted);
+            }
+            catch (const std::exception& e)
+            {
+                res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
             }
         };
 
-        res->onData(onData);
-        res->onAborted([isAborted]()
-                       { *isAborted = true; });
+        onBody(res, req, handle);
     };
     this->m_apps->at(app_num).post("/todo", create_todo);
 
@@ -136,8 +185,13 @@ void TodoServer::startServer(uint app_num, int port)
     // ================================================================================================
     auto delete_todo = [this](auto* res, auto* req)
     {
-        auto todoId = std::stoi(std::string(req->getParameter(0)));
-        deleteTodo(res, todoId);
+        uint todoId;
+        if (!Param<uint>::parse(req->getParameter(0), todoId))
+        {
+            res->writeStatus("400 Bad Request")->end("invalid id: " + std::string(req->getParameter(0)));
+            return;
+        }
+        deleteTodo(res, todoId, acceptedFormat(req->getHeader("accept")));
     };
     this->m_apps->at(app_num).del("/todo/:id", delete_todo);
 
@@ -146,50 +200,192 @@ void TodoServer::startServer(uint app_num, int port)
     // ================================================================================================
     auto modify_todo = [this](auto* res, auto* req)
     {
-        int todoId = std::stoi(std::string(req->getParameter(0)));
-        auto isAborted = std::make_shared<bool>(false);
-        std::string buffer;
+        uint todoId;
+        if (!Param<uint>::parse(req->getParameter(0), todoId) || !IdAllocator::valid(todoId))
+        {
+            res->writeStatus("400 Bad Request")->end("invalid id: " + std::string(req->getParameter(0)));
+            return;
+        }
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto accepted = acceptedFormat(req->getHeader("accept"));
 
-        auto onData = [this,
-                       res,
-                       isAborted,
-                       todoId,
-                       buffer = std::move(buffer)](std::string_view data, bool last) mutable
+        auto handle = [this, todoId, format, accepted](auto* res, std::string_view buffer)
         {
-            buffer.append(data.data(), data.length());
-            if (last)
+            try
             {
-                try
+                std::string description;
+                bool completed;
+                std::optional<TodoFields> fields;
+                if (format == WireFormat::Json && (fields = scanTodoFields(buffer)))
                 {
-                    nlohmann::json body = nlohmann::json::parse(buffer);
-                    std::string description = body.value("description", "");
-                    bool completed = body.value("completed", false);
-
-                    if (!*isAborted)
-                        modifyTodo(res, todoId, description, completed);
+                    description = std::move(fields->description).value_or("");
+                    completed = fields->completed.value_or(false);
                 }
-                catch (const std::exception& e)
+                else
                 {
-                    res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+                    nlohmann::json body = decodeBody(buffer, format);
+                    description = body.value("description", "");
+                    completed = body.value("completed", false);
                 }
+
+                modifyTodo(res, todoId, description, completed, accepted);
+            }
+            catch (const std::exception& e)
+            {
+                res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
             }
         };
-        res->onData(onData);
-        res->onAborted([isAborted]()
-                       { *isAborted = true; });
+        onBody(res, req, handle);
     };
     this->m_apps->at(app_num).put("/todo/:id", modify_todo);
 
+    // ================================================================================================
+    // patch_todo: only the fields present in the body change
+    // ================================================================================================
+    auto patch_todo = [this](auto* res, auto* req)
+    {
+        uint todoId;
+        if (!Param<uint>::parse(req->getParameter(0), todoId))
+        {
+            res->writeStatus("400 Bad Request")->end("invalid id: " + std::string(req->getParameter(0)));
+            return;
+        }
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto accepted = acceptedFormat(req->getHeader("accept"));
+
+        auto handle = [this, todoId, format, accepted](auto* res, std::string_view buffer)
+        {
+            try
+            {
+                patchTodo(res, todoId, parseTodoFields(buffer, format), accepted);
+            }
+            catch (const std::exception& e)
+            {
+                res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+            }
+        };
+        onBody(res, req, handle);
+    };
+    this->m_apps->at(app_num).patch("/todo/:id", patch_todo);
+
+    // ================================================================================================
+    // batches: create_todos/modify_todos take an array of todos, delete_todos an array of ids
+    // ================================================================================================
+    auto create_todos = [this](auto* res, auto* req)
+    {
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto accepted = acceptedFormat(req->getHeader("accept"));
+        onBody(res, req, [this, format, accepted](auto* res, std::string_view body)
+               {
+                   try
+                   {
+                       std::vector<Todo> todos;
+                       for (auto& fields : parseTodoFieldsList(body, format))
+                       {
+                           if (!fields.description || !fields.completed)
+                               throw std::invalid_argument("description and completed are required");
+                           todos.push_back(Todo{0, std::move(*fields.description), *fields.completed});
+                       }
+                       createTodos(res, std::move(todos), accepted);
+                   }
+                   catch (const std::exception& e)
+                   {
+                       res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+                   } });
+    };
+    this->m_apps->at(app_num).post("/todos/batch", create_todos);
+
+    auto modify_todos = [this](auto* res, auto* req)
+    {
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto accepted = acceptedFormat(req->getHeader("accept"));
+        onBody(res, req, [this, format, accepted](auto* res, std::string_view body)
+               {
+                   try
+                   {
+                       std::vector<Todo> todos;
+                       for (auto& fields : parseTodoFieldsList(body, format))
+                       {
+                           if (!fields.id || !IdAllocator::valid(*fields.id))
+                               throw std::invalid_argument("a valid id is required");
+                           todos.push_back(Todo{*fields.id, std::move(fields.description).value_or(""), fields.completed.value_or(false)});
+                       }
+                       modifyTodos(res, todos, accepted);
+                   }
+                   catch (const std::exception& e)
+                   {
+                       res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+                   } });
+    };
+    this->m_apps->at(app_num).put("/todos/batch", modify_todos);
+
+    auto delete_todos = [this](auto* res, auto* req)
+    {
+        auto format = bodyFormat(req->getHeader("content-type"));
+        auto accepted = acceptedFormat(req->getHeader("accept"));
+        onBody(res, req, [this, format, accepted](auto* res, std::string_view body)
+               {
+                   try
+                   {
+                       deleteTodos(res, parseTodoIds(body, format), accepted);
+                   }
+                   catch (const std::exception& e)
+                   {
+                       res->writeStatus("400 Bad Request")->end("Invalid JSON payload");
+                   } });
+    };
+    this->m_apps->at(app_num).del("/todos/batch", delete_todos);
+
     // ================================================================================================
     // WebSocket route
     // ================================================================================================
-    this->m_apps->at(app_num).ws<WsData>("/*", {
-                                                   .open = [this](auto* ws)
-                                                   { handleWebSocketConnection(ws); },
+    this->m_apps->at(app_num).ws<WsSession>("/*", {
+                                                   // one deflate stream per loop, no per-socket window
+                                                   .compression = uWS::SHARED_COMPRESSOR,
+                                                   // hard cap behind the slow consumer policy, see checkBackpressure
+                                                   .maxBackpressure = 2 * this->m_backpressure.limit,
+                                                   .closeOnBackpressureLimit = this->m_backpressure.policy == SlowConsumer::Disconnect,
+                                                   .upgrade = [](auto* res, auto* req, auto* context)
+                                                   {
+                                                       // broadcast format: ?format=msgpack|cbor, else the Accept header
+                                                       WsSession data;
+                                                       auto format = req->getQuery("format");
+                                                       data.format = format && *format == "msgpack" ? WireFormat::MsgPack
+                                                                     : format && *format == "cbor"  ? WireFormat::Cbor
+                                                                                                    : acceptedFormat(req->getHeader("accept"));
+                                                       res->template upgrade<WsSession>(std::move(data),
+                                                                                        req->getHeader("sec-websocket-key"),
+                                                                                        req->getHeader("sec-websocket-protocol"),
+                                                                                        req->getHeader("sec-websocket-extensions"),
+                                                                                        context);
+                                                   },
+                                                   .open = [this, ws_loop](auto* ws)
+                                                   {
+                                                       ws_loop->sockets.insert(ws);
+                                                       handleWebSocketConnection(ws);
+                                                   },
                                                    .message = [this](auto* ws, std::string_view message, uWS::OpCode)
                                                    { handleWebSocketMessage(ws, message); },
-                                                   .close = [this](auto* ws, int, std::string_view)
-                                                   { handleWebSocketClose(ws); },
+                                                   .drain = [this](auto* ws)
+                                                   {
+                                                       if (ws->getUserData()->lagging && this->m_backpressure.policy != SlowConsumer::Disconnect &&
+                                                           ws->getBufferedAmount() <= this->m_backpressure.limit / 2)
+                                                           this->release(ws);
+                                                   },
+                                                   .subscription = [this](auto*, std::string_view topic, int newCount, int oldCount)
+                                                   {
+                                                       if (isScopedTopic(topic))
+                                                           this->m_scoped.add(topic, newCount - oldCount);
+                                                       else if (topic == "query")
+                                                           this->m_query_subscribers.fetch_add(newCount - oldCount, std::memory_order_relaxed);
+                                                       else if (auto format = topicFormat(topic); format != WireFormat::Json)
+                                                           this->m_binary_subscribers[static_cast<int>(format)].fetch_add(newCount - oldCount, std::memory_order_relaxed);
+                                                   },
+                                                   .close = [this, ws_loop](auto* ws, int, std::string_view)
+                                                   {
+                                                       ws_loop->sockets.erase(ws);
+                                                       handleWebSocketClose(ws);
+                                                   },
                                                });
 
     // ================================================================================================
@@ -216,109 +412,459 @@ void TodoServer::startServer(uint app_num, int port)
 
 // HTTP API Implementations
 
-void TodoServer::getTodo(uWS::HttpResponse<false>* res, uint todoId)
+void TodoServer::getTodo(Replier to, uint todoId, WireFormat format)
 {
-    std::shared_lock lock(this->m_mutex);
-    std::string msg;
+    TodoEvent event{.name = "getTodo"};
+    std::optional<std::string> json;
+    if (this->needsTodos(to, format))
+    {
+        if (auto todo = this->m_todos->find(todoId))
+        {
+            json = toJsonString(*todo);
+            event.todos.push_back(std::move(*todo));
+        }
+    }
+    else
+        json = this->m_todos->findJson(todoId);
+
+    auto tid = getTid();
+    if (json)
+        event.message = fmt::format("[{}] getTodo: {}", tid, *json);
+    else
+        event.message = fmt::format("[{}] getTodo failed: {}", tid, todoId);
+    this->reply(to, event, format);
+    this->broadcastEvent("query", std::move(event));
+}
+
+void TodoServer::deleteTodo(Replier to, uint todoId, WireFormat format)
+{
+    TodoEvent event{.name = "deleteTodo"};
+    std::string json;
+    Wal::Lsn lsn = 0;
+    auto todos = this->needsTodos(to, format) ? &event.todos : nullptr;
+
     auto tid = getTid();
+    if (this->m_todos->erase(todoId, this->journal(WalOp::Erase, lsn, event.seq, json, todos)))
+        event.message = fmt::format("[{}] deleteTodo: {}", tid, json);
+    else
+        event.message = fmt::format("[{}] deleteTodo failed: {}", tid, todoId);
+    this->endDurable(std::move(to), "mutation", std::move(event), format, lsn);
+}
+
+// A created todo gets the next free id. Ids are only taken by a client PUT after it raised the
+// allocator above them, but a create handed one just before loses the insert and takes another.
+// Subscribers see a create as a modification, as before.
+void TodoServer::createTodo(Replier to, const std::string& description, bool completed, WireFormat format)
+{
+    Todo todo{0, description, completed};
+    TodoEvent event{.name = "modifyTodo", .relists = true};
+    std::string json;
+    Wal::Lsn lsn = 0;
+    auto todos = this->needsTodos(to, format) ? &event.todos : nullptr;
+    auto hook = this->journal(WalOp::Upsert, lsn, event.seq, json, todos);
+    do
+        todo.id = this->m_ids.next();
+    while (!this->m_todos->insert(todo, hook));
+    event.message = fmt::format("[{}] modifyTodo: {}", getTid(), json);
+
+    this->endDurable(std::move(to), "mutation", std::move(event), format, lsn);
+}
 
-    if (this->m_todos->find(todoId) != this->m_todos->end())
+void TodoServer::modifyTodo(Replier to, uint todoId, const std::string& description, bool completed, WireFormat format)
+{
+    Todo todo{todoId, description, completed};
+    TodoEvent event{.name = "modifyTodo", .relists = true};
+    std::string json;
+    Wal::Lsn lsn = 0;
+    auto todos = this->needsTodos(to, format) ? &event.todos : nullptr;
+    this->m_ids.observe(todoId);
+    this->m_todos->upsert(todo, this->journal(WalOp::Upsert, lsn, event.seq, json, todos));
+    auto tid = getTid();
+    event.message = fmt::format("[{}] modifyTodo: {}", tid, json);
+
+    this->endDurable(std::move(to), "mutation", std::move(event), format, lsn);
+}
+
+// The todo is patched in place; the client gets it whole, subscribers only the supplied fields
+void TodoServer::patchTodo(Replier to, uint todoId, TodoFields fields, WireFormat format)
+{
+    TodoEvent event{.name = "patchTodo"};
+    std::string json;
+    Wal::Lsn lsn = 0;
+    auto todos = format != WireFormat::Json || to.ws || this->m_scoped.any() ? &event.todos : nullptr;
+
+    auto tid = getTid();
+    fields.id = todoId;
+    if (this->m_todos->patch(todoId, fields, this->journal(WalOp::Upsert, lsn, event.seq, json, todos)))
     {
-        nlohmann::json todoJson = this->m_todos->at(todoId);
-        msg = fmt::format("[{}] getTodo: {}", tid, todoJson.dump());
-        res->end(msg);
+        event.message = fmt::format("[{}] patchTodo: {}", tid, json);
+        event.relists = fields.completed.has_value();
+        event.delta = std::move(fields);
     }
     else
+        event.message = fmt::format("[{}] patchTodo failed: {}", tid, todoId);
+    this->endDurable(std::move(to), "mutation", std::move(event), format, lsn);
+}
+
+// Batches are applied with one lock acquisition per shard and answered, and broadcast, as a
+// single message listing every applied todo
+
+void TodoServer::createTodos(Replier to, std::vector<Todo> todos, WireFormat format)
+{
+    TodoEvent event{.name = "createTodos", .batch = true};
+    std::string list;
+    Wal::Lsn lsn = 0;
+    auto applied = this->needsTodos(to, format) ? &event.todos : nullptr;
+    auto journal = this->journalBatch(WalOp::Upsert, lsn, event.seq, list, applied);
+
+    // one block of ids for the whole batch, the todos whose id a client PUT took meanwhile get
+    // another block
+    while (!todos.empty())
     {
-        msg = fmt::format("[{}] getTodo failed: {}", tid, todoId);
-        res->end(msg);
+        auto first = this->m_ids.reserve(static_cast<uint>(todos.size()));
+        for (std::size_t i = 0; i < todos.size(); ++i)
+            todos[i].id = first + static_cast<uint>(i);
+
+        std::vector<char> inserted(todos.size(), 0);
+        auto n = this->m_todos->insertMany(todos, [&](const Todo& todo, std::string_view json)
+                                           { inserted[todo.id - first] = 1; journal(todo, json); });
+        if (n == todos.size())
+            break;
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < todos.size(); ++i)
+            if (!inserted[i])
+                todos[kept++] = std::move(todos[i]);
+        todos.resize(kept);
     }
-    this->broadcastMessage("query", msg);
+    event.message = fmt::format("[{}] createTodos: {}", getTid(), closeList(list));
+
+    this->endDurable(std::move(to), "mutation", std::move(event), format, lsn);
 }
 
-void TodoServer::deleteTodo(uWS::HttpResponse<false>* res, uint todoId)
+void TodoServer::modifyTodos(Replier to, const std::vector<Todo>& todos, WireFormat format)
 {
-    std::unique_lock lock(this->m_mutex);
-    auto it = this->m_todos->find(todoId);
-    auto tid = getTid();
-    std::string msg;
+    TodoEvent event{.name = "modifyTodos", .batch = true, .relists = true};
+    std::string list;
+    Wal::Lsn lsn = 0;
+    auto applied = this->needsTodos(to, format) ? &event.todos : nullptr;
+    for (const auto& todo : todos)
+        this->m_ids.observe(todo.id);
+    this->m_todos->upsertMany(todos, this->journalBatch(WalOp::Upsert, lsn, event.seq, list, applied));
+    event.message = fmt::format("[{}] modifyTodos: {}", getTid(), closeList(list));
+
+    this->endDurable(std::move(to), "mutation", std::move(event), format, lsn);
+}
+
+void TodoServer::deleteTodos(Replier to, const std::vector<uint>& todoIds, WireFormat format)
+{
+    TodoEvent event{.name = "deleteTodos", .batch = true};
+    std::string list;
+    Wal::Lsn lsn = 0;
+    auto applied = this->needsTodos(to, format) ? &event.todos : nullptr;
+    this->m_todos->eraseMany(todoIds, this->journalBatch(WalOp::Erase, lsn, event.seq, list, applied));
+    event.message = fmt::format("[{}] deleteTodos: {}", getTid(), closeList(list));
 
-    if (it != this->m_todos->end())
+    this->endDurable(std::move(to), "mutation", std::move(event), format, lsn);
+}
+
+void TodoServer::getAllTodos(uWS::HttpResponse<false>* res, std::optional<bool> completed, std::string_view ifNoneMatch, WireFormat format, bool gzip)
+{
+    // every mutation bumps the store version, so an unchanged version means an unchanged list
+    auto version = this->m_todos->version();
+    auto etag = makeETag(version, format);
+    if (etagMatches(ifNoneMatch, etag))
+    {
+        // the status goes first, uWS writes "200 OK" ahead of any earlier header
+        res->writeStatus("304 Not Modified");
+        res->writeHeader("Vary", "Accept, Accept-Encoding");
+        res->writeHeader("ETag", etag);
+        res->endWithoutBody();
+        return;
+    }
+
+    // one consistent list for the whole response, streamed in bounded chunks
+    auto snapshot = this->m_todos->snapshot();
+    auto prefix = fmt::format("[{}] allTodos: ", getTid());
+    res->writeHeader("Vary", "Accept, Accept-Encoding");
+    res->writeHeader("ETag", makeETag(snapshot->version, format));
+
+    // broadcast to ws subscribers, the only place the whole message is still rendered
+    if (this->m_query_subscribers.load(std::memory_order_relaxed) > 0)
+    {
+        if (completed)
+        {
+            std::string msg = prefix;
+            TodoListWriter(snapshot, completed).next(msg, SIZE_MAX);
+            this->broadcastMessage("query", std::move(msg));
+        }
+        else
+        {
+            // the unfiltered list is rendered once per version by whichever worker gets there
+            // first, every other worker publishes that same event again
+            auto rendered = this->m_query_frame.load(std::memory_order_acquire);
+            if (!rendered || rendered->version != snapshot->version)
+            {
+                std::string msg = prefix;
+                TodoListWriter(snapshot).next(msg, SIZE_MAX);
+                rendered = std::make_shared<const QueryFrame>(QueryFrame{snapshot->version, makeBroadcast("query", std::move(msg), uWS::OpCode::TEXT)});
+                this->m_query_frame.store(rendered, std::memory_order_release);
+            }
+            this->broadcastMessage(rendered->event);
+        }
+    }
+    for (auto binary : {WireFormat::MsgPack, WireFormat::Cbor})
+    {
+        if (this->m_binary_subscribers[static_cast<int>(binary)].load(std::memory_order_relaxed) == 0)
+            continue;
+        std::string msg;
+        BinaryWriter(msg, binary).map(2).string("event").string("allTodos").string("todos");
+        TodoListWriter(snapshot, completed, binary).next(msg, SIZE_MAX);
+        this->broadcastMessage(formatTopic("query", binary), std::move(msg), uWS::OpCode::BINARY);
+    }
+
+    // binary bodies are the bare list
+    if (format != WireFormat::Json)
     {
-        nlohmann::json t = this->m_todos->at(todoId);
-        msg = fmt::format("[{}] deleteTodo: {}", tid, t.dump());
-        this->m_todos->erase(todoId);
-        res->end(msg);
+        res->writeHeader("Content-Type", mimeType(format));
+        prefix.clear();
     }
+    // gzip needs the whole body, rendered and compressed once per store version
+    if (gzip)
+    {
+        const auto& body = gzipTodos(snapshot, completed, format, prefix);
+        if (body.gzipped)
+            res->writeHeader("Content-Encoding", "gzip");
+        res->end(body.body);
+        return;
+    }
+    if (auto rendered = renderTodos(snapshot, completed, format))
+        streamTodos(res, std::move(rendered), std::move(prefix));
     else
+        streamTodos(res, TodoListWriter(std::move(snapshot), completed, format), std::move(prefix));
+}
+
+void TodoServer::getTodoStats(uWS::HttpResponse<false>* res, WireFormat format)
+{
+    auto total = this->m_todos->size();
+    auto completed = this->m_todos->countCompleted();
+    if (format != WireFormat::Json)
     {
-        msg = fmt::format("[{}] deleteTodo failed: {}", tid, todoId);
-        res->end(msg);
+        std::string body;
+        BinaryWriter(body, format).map(2).string("completed").number(completed).string("total").number(total);
+        res->writeHeader("Content-Type", mimeType(format))->end(body);
+        return;
     }
-    this->broadcastMessage("mutation", msg);
+
+    nlohmann::json stats = {
+        {"total", total},
+        {"completed", completed},
+    };
+    res->end(stats.dump());
 }
 
-void TodoServer::modifyTodo(uWS::HttpResponse<false>* res, uint todoId, const std::string& description, bool completed)
+// Queue depth of every topic summed over the workers, as of their last sample, and the slow
+// consumers seen so far
+void TodoServer::getWsStats(uWS::HttpResponse<false>* res)
 {
-    std::unique_lock lock(this->m_mutex);
-    (*this->m_todos).insert({todoId, Todo{todoId, description, completed}});
-    auto tid = getTid();
-    nlohmann::json t = this->m_todos->at(todoId);
-    auto msg = fmt::format("[{}] modifyTodo: {}", tid, t.dump());
+    std::unordered_map<std::string, TopicDepth> depths;
+    {
+        std::lock_guard lock(this->m_depth_mutex);
+        for (const auto& [app_num, loop] : this->m_depths)
+            for (const auto& [topic, depth] : loop)
+            {
+                auto& sum = depths[topic];
+                sum.sockets += depth.sockets;
+                sum.buffered += depth.buffered;
+                sum.lagging += depth.lagging;
+            }
+    }
+
+    nlohmann::json topics = nlohmann::json::object();
+    for (const auto& [topic, depth] : depths)
+        topics[topic] = {{"sockets", depth.sockets}, {"buffered", depth.buffered}, {"lagging", depth.lagging}};
 
-    res->end(msg);
-    this->broadcastMessage("mutation", msg);
+    static constexpr const char* kPolicies[] = {"drop-oldest", "resync", "disconnect"};
+    nlohmann::json stats = {
+        {"policy", kPolicies[static_cast<int>(this->m_backpressure.policy)]},
+        {"limit", this->m_backpressure.limit},
+        {"slow_consumers", this->m_slow_consumers.load(std::memory_order_relaxed)},
+        {"resyncs", this->m_resyncs.load(std::memory_order_relaxed)},
+        {"disconnects", this->m_disconnects.load(std::memory_order_relaxed)},
+        {"topics", topics},
+    };
+    res->end(stats.dump());
 }
 
-void TodoServer::getAllTodos(uWS::HttpResponse<false>* res)
+// Durability
+
+// Logs the mutation when a Wal is configured and numbers it for the changefeed, both while the
+// todo is still locked, then keeps the cached JSON for the reply, plus the todo itself when
+// `todos` is given
+TodoHook TodoServer::journal(WalOp op, Wal::Lsn& lsn, uint64_t& seq, std::string& json, std::vector<Todo>* todos)
 {
-    std::shared_lock lock(this->m_mutex);
-    nlohmann::json allTodos = nlohmann::json::array();
-    for (const auto& [id, todo] : *this->m_todos.get())
+    return [this, op, &lsn, &seq, &json, todos](const Todo& todo, std::string_view cached)
     {
-        allTodos.push_back({
-            {"id", todo.id},
-            {"description", todo.description},
-            {"completed", todo.completed},
-        });
+        json = cached;
+        if (todos)
+            todos->push_back(todo);
+        if (this->m_wal)
+            lsn = this->m_wal->append(op, todo);
+        if (this->m_changefeed)
+            seq = this->m_changefeed->reserve();
+    };
+}
+
+// journal for batches, collecting the JSON of every applied todo into `list`
+TodoHook TodoServer::journalBatch(WalOp op, Wal::Lsn& lsn, uint64_t& seq, std::string& list, std::vector<Todo>* todos)
+{
+    return [this, op, &lsn, &seq, &list, todos](const Todo& todo, std::string_view cached)
+    {
+        list.push_back(list.empty() ? '[' : ',');
+        list.append(cached);
+        if (todos)
+            todos->push_back(todo);
+        if (this->m_wal)
+            lsn = std::max(lsn, this->m_wal->append(op, todo));
+        // the store holds every shard of the batch meanwhile, one number covers it
+        if (this->m_changefeed && seq == 0)
+            seq = this->m_changefeed->reserve();
+    };
+}
+
+std::string& TodoServer::closeList(std::string& list)
+{
+    if (list.empty())
+        list.push_back('[');
+    list.push_back(']');
+    return list;
+}
+
+// whether the todos of an event must be kept: for a binary or RPC reply, any binary or scoped
+// subscriber, or the binary replays of the changefeed
+bool TodoServer::needsTodos(const Replier& to, WireFormat format) const
+{
+    return format != WireFormat::Json || to.ws || this->m_changefeed || this->m_scoped.any() ||
+           this->m_binary_subscribers[static_cast<int>(WireFormat::MsgPack)].load(std::memory_order_relaxed) > 0 ||
+           this->m_binary_subscribers[static_cast<int>(WireFormat::Cbor)].load(std::memory_order_relaxed) > 0;
+}
+
+void TodoServer::endDurable(Replier to, std::string topic, TodoEvent event, WireFormat format, Wal::Lsn lsn)
+{
+    if (!this->m_wal || lsn == 0)
+    {
+        this->reply(to, event, format);
+        this->broadcastEvent(topic, std::move(event));
+        return;
     }
-    auto tid = getTid();
-    auto msg = fmt::format("[{}] allTodos: {}", tid, allTodos.dump());
-    res->end(msg);
-    // broadcast to ws subscribers
-    this->broadcastMessage("query", msg);
+
+    // an HTTP response is ended later from this loop, uWS requires an abort handler meanwhile; a
+    // ws client is checked by reply
+    auto isAborted = std::make_shared<bool>(false);
+    if (to.res)
+        to.res->onAborted([isAborted]()
+                          { *isAborted = true; });
+
+    auto loop = uWS::Loop::get();
+    auto onDurable = [this, loop, to = std::move(to), isAborted, topic = std::move(topic), event = std::move(event), format]() mutable
+    {
+        auto reply = [this, to = std::move(to), isAborted, topic = std::move(topic), event = std::move(event), format]() mutable
+        {
+            if (!*isAborted)
+                this->reply(to, event, format);
+            this->broadcastEvent(topic, std::move(event));
+        };
+        loop->defer(std::move(reply));
+    };
+    this->m_wal->whenDurable(lsn, std::move(onDurable));
+}
+
+// JSON clients get the event message; binary ones the todo (nil when there is none) or, for
+// batches, the array of applied todos. RPC calls get the same todo or array as their result, or an
+// error when there is no todo.
+void TodoServer::reply(const Replier& to, const TodoEvent& event, WireFormat format)
+{
+    if (to.ws)
+    {
+        if (!*to.alive)
+            return;
+        if (event.batch || !event.todos.empty())
+        {
+            auto result = [&event](std::string& out)
+            {
+                JsonWriter w(out);
+                if (event.batch)
+                    writeJson(w, event.todos);
+                else
+                    writeJson(w, event.todos.front());
+            };
+            to.ws->send(rpcResult(to.rpcId, result), uWS::OpCode::TEXT);
+        }
+        else
+            to.ws->send(rpcError(to.rpcId, event.name + " failed: not found"), uWS::OpCode::TEXT);
+        return;
+    }
+
+    auto* res = to.res;
+    if (format == WireFormat::Json)
+    {
+        res->end(event.message);
+        return;
+    }
+
+    std::string body;
+    BinaryWriter w(body, format);
+    if (event.batch)
+        writeBinary(w, event.todos);
+    else if (!event.todos.empty())
+        writeBinary(w, event.todos.front());
+    else
+        w.nil();
+    res->writeHeader("Content-Type", mimeType(format))->end(body);
 }
 
 // WebSocket Handling
 
-void TodoServer::handleWebSocketConnection(uWS::WebSocket<false, true, WsData>* ws)
+void TodoServer::handleWebSocketConnection(uWS::WebSocket<false, true, WsSession>* ws)
 {
     auto tid = getTid();
     auto msg = fmt::format("tid: {}", tid);
     ws->send(msg, uWS::OpCode::TEXT);
 }
 
-void TodoServer::handleWebSocketMessage(uWS::WebSocket<false, true, WsData>* ws, std::string_view message)
+void TodoServer::handleWebSocketMessage(uWS::WebSocket<false, true, WsSession>* ws, std::string_view message)
 {
     // subscription payload:
     // {"action": "subscribe", "topic": "xxx"}
     // {"action": "unsubscribe", "topic": "xxx"}
     // {"action": "subscriptions"}
-    // xxx: all/query/mutation/random
+    // xxx: all/query/mutation/random, or todo:<id> and todos:completed|active for the mutations
+    // of one todo or one list
+    // subscribing to all/mutation with "from_seq": N also sends the mutation events after N
+    // query/mutation events reach binary clients (see the upgrade handler) encoded in their format
+    // messages with an "op" are RPC calls, see handleRpc
+
+    auto wireTopic = [ws](std::string_view topic)
+    {
+        if (topic == "query" || topic == "mutation" || isScopedTopic(topic))
+            return formatTopic(topic, ws->getUserData()->format);
+        return std::string(topic);
+    };
 
     try
     {
         // Parse the message as JSON
         nlohmann::json request = nlohmann::json::parse(message);
 
+        if (isRpc(request))
+            this->handleRpc(ws, request);
         // Check if the message requests a subscription
-        if (request.contains("action") && request["action"] == "subscribe" && request.contains("topic"))
+        else if (request.contains("action") && request["action"] == "subscribe" && request.contains("topic"))
         {
             std::string topic = request["topic"];
             if (topic == "all")
             {
-                ws->subscribe("query");
-                ws->subscribe("mutation");
+                ws->subscribe(wireTopic("query"));
+                ws->subscribe(wireTopic("mutation"));
                 ws->subscribe("random");
 
                 ws->send("Subscribed to all topics: query/mutation/random", uWS::OpCode::TEXT);
@@ -326,18 +872,25 @@ void TodoServer::handleWebSocketMessage(uWS::WebSocket<false, true, WsData>* ws,
             else
             {
                 // Subscribe the WebSocket client to the specified topic
-                ws->subscribe(topic);
+                ws->subscribe(wireTopic(topic));
                 // Acknowledge the subscription
                 ws->send("Subscribed to topic: " + topic, uWS::OpCode::TEXT);
             }
+            if ((topic == "all" || topic == "mutation") && request.contains("from_seq"))
+            {
+                if (this->m_changefeed)
+                    this->resumeFeed(ws, request["from_seq"].get<uint64_t>());
+                else
+                    ws->send("Changefeed is disabled", uWS::OpCode::TEXT);
+            }
         }
         else if (request.contains("action") && request["action"] == "unsubscribe" && request.contains("topic"))
         {
             std::string topic = request["topic"];
             if (topic == "all")
             {
-                ws->unsubscribe("query");
-                ws->unsubscribe("mutation");
+                ws->unsubscribe(wireTopic("query"));
+                ws->unsubscribe(wireTopic("mutation"));
                 ws->unsubscribe("random");
 
                 ws->send("Unsubscribed to all topics: query/mutation/random", uWS::OpCode::TEXT);
@@ -345,7 +898,7 @@ void TodoServer::handleWebSocketMessage(uWS::WebSocket<false, true, WsData>* ws,
             else
             {
                 // Unsubscribe the WebSocket client to the specified topic
-                ws->unsubscribe(topic);
+                ws->unsubscribe(wireTopic(topic));
                 // Acknowledge the subscription
                 ws->send("Unsubscribed to topic: " + topic, uWS::OpCode::TEXT);
             }
@@ -355,6 +908,8 @@ void TodoServer::handleWebSocketMessage(uWS::WebSocket<false, true, WsData>* ws,
             nlohmann::json topics = nlohmann::json::array();
             auto iter_topics = [&topics, ws](std::string_view topic)
             {
+                if (topicFormat(topic) != WireFormat::Json)
+                    topic = topic.substr(0, topic.rfind('/'));
                 topics.push_back(topic);
             };
             ws->iterateTopics(iter_topics);
@@ -374,23 +929,373 @@ void TodoServer::handleWebSocketMessage(uWS::WebSocket<false, true, WsData>* ws,
     }
 }
 
-void TodoServer::handleWebSocketClose(uWS::WebSocket<false, true, WsData>* ws)
+// CRUD over the socket: each call goes through the same path as its HTTP route and is answered, as
+// soon as it is durable, with {"id", "ok", "result" | "error"}. Calls are not ordered with respect
+// to each other's replies, the id tells them apart.
+void TodoServer::handleRpc(uWS::WebSocket<false, true, WsSession>* ws, const nlohmann::json& request)
 {
+    auto id = rpcId(request);
+    try
+    {
+        auto call = parseRpc(request);
+        auto* data = ws->getUserData();
+        if (!data->alive)
+            data->alive = std::make_shared<bool>(true);
+        Replier to(ws, data->alive, id);
+
+        switch (call.op)
+        {
+            case RpcOp::Create:
+                this->createTodo(std::move(to), *call.fields.description, *call.fields.completed);
+                break;
+            case RpcOp::Modify:
+                if (!IdAllocator::valid(*call.fields.id))
+                    throw std::invalid_argument("invalid id: " + std::to_string(*call.fields.id));
+                this->modifyTodo(std::move(to), *call.fields.id, call.fields.description.value_or(""), call.fields.completed.value_or(false));
+                break;
+            case RpcOp::Delete:
+                this->deleteTodo(std::move(to), call.todoId);
+                break;
+            case RpcOp::Get:
+                this->getTodo(std::move(to), call.todoId);
+                break;
+            case RpcOp::List:
+            {
+                auto result = [this, &call](std::string& out)
+                { TodoListWriter(this->m_todos->snapshot(), call.completed).next(out, SIZE_MAX); };
+                ws->send(rpcResult(id, result), uWS::OpCode::TEXT);
+                break;
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        ws->send(rpcError(id, e.what()), uWS::OpCode::TEXT);
+    }
+}
+
+void TodoServer::handleWebSocketClose(uWS::WebSocket<false, true, WsSession>* ws)
+{
+    // RPC replies still waiting for durability are dropped
+    if (auto& alive = ws->getUserData()->alive)
+        *alive = false;
     ws->close();
 }
 
-// Broadcast to all WebSocket clients
-void TodoServer::broadcastMessage(const std::string& topic, const std::string& message)
+// Broadcast to all WebSocket clients: one shared event, queued on every worker loop
+void TodoServer::broadcastMessage(std::string topic, std::string message, uWS::OpCode opCode)
+{
+    this->m_broadcaster.publish(makeBroadcast(std::move(topic), std::move(message), opCode));
+}
+
+void TodoServer::broadcastMessage(BroadcastEventPtr event)
+{
+    this->m_broadcaster.publish(std::move(event));
+}
+
+// Mutation events numbered by their hook are rendered here, then kept and queued in sequence order
+// by the changefeed, so every loop publishes them in the order the store applied them; anything
+// else (including mutations that changed nothing) is published as is.
+void TodoServer::broadcastEvent(const std::string& topic, TodoEvent&& event)
+{
+    std::vector<BroadcastEventPtr> frames;
+    if (topic != "mutation" || !this->m_changefeed || event.seq == 0)
+    {
+        this->renderEvent(topic, event, 0, frames);
+        for (auto& frame : frames)
+            this->broadcastMessage(std::move(frame));
+        return;
+    }
+
+    auto seq = event.seq;
+    auto kept = std::make_shared<TodoEvent>(std::move(event));
+    this->renderEvent(topic, *kept, seq, frames);
+    // replays send the text frame, the message is no longer needed
+    kept->message = {};
+    auto text = frames.front();
+    auto release = [this](FeedEntry& entry)
+    {
+        for (auto& frame : entry.frames)
+            this->broadcastMessage(std::move(frame));
+        entry.frames.clear();
+    };
+    this->m_changefeed->put(seq, FeedEntry{std::move(text), std::move(kept), std::move(frames)}, release);
+}
+
+// JSON subscribers get the text of an event, binary ones its encoded map; `seq` 0 is unnumbered.
+// Every payload is rendered once into `frames`, the text first, each then handed to all loops as
+// one shared event.
+void TodoServer::renderEvent(const std::string& topic, TodoEvent& event, uint64_t seq, std::vector<BroadcastEventPtr>& frames)
 {
-    for (auto& pair : *this->m_apps)
+    frames.push_back(makeBroadcast(topic, eventText(event, seq), uWS::OpCode::TEXT));
+    for (auto binary : {WireFormat::MsgPack, WireFormat::Cbor})
     {
-        auto loop = pair.second.getLoop();
-        auto defer = [this, message, topic, &pair]()
+        if (this->m_binary_subscribers[static_cast<int>(binary)].load(std::memory_order_relaxed) == 0)
+            continue;
+        frames.push_back(makeBroadcast(formatTopic(topic, binary), eventBinary(event, binary, seq), uWS::OpCode::BINARY));
+    }
+    if (topic == "mutation")
+        this->renderScoped(event, frames);
+}
+
+// Scoped subscribers get the todos of a mutation that concern them, as stored after it (deletes:
+// as removed): a "todo:<id>" topic its todo, a list topic the ones in that list. Nothing is
+// rendered for topics without subscribers.
+void TodoServer::renderScoped(const TodoEvent& event, std::vector<BroadcastEventPtr>& frames)
+{
+    if (!this->m_scoped.any())
+        return;
+
+    std::array<std::vector<const Todo*>, 2> lists;  // active, completed
+    for (const auto& todo : event.todos)
+    {
+        lists[todo.completed].push_back(&todo);
+        this->renderScopedTo(fmt::format("todo:{}", todo.id), event, {&todo}, frames);
+    }
+    // the previous flag is not known here, so a modification goes to both lists: on the one the
+    // todo does not belong to, its `completed` value tells subscribers it has left (or was never in)
+    if (event.relists)
+    {
+        std::vector<const Todo*> all;
+        all.reserve(event.todos.size());
+        for (const auto& todo : event.todos)
+            all.push_back(&todo);
+        lists = {all, all};
+    }
+    this->renderScopedTo("todos:active", event, lists[0], frames);
+    this->renderScopedTo("todos:completed", event, lists[1], frames);
+}
+
+// "[tid] name: " and the todo (an array for batches) for JSON subscribers, {"event", "todos"} for
+// binary ones
+void TodoServer::renderScopedTo(const std::string& topic, const TodoEvent& event, const std::vector<const Todo*>& todos, std::vector<BroadcastEventPtr>& frames)
+{
+    if (todos.empty())
+        return;
+
+    for (auto format : {WireFormat::Json, WireFormat::MsgPack, WireFormat::Cbor})
+    {
+        auto wire = formatTopic(topic, format);
+        if (!this->m_scoped.interested(wire))
+            continue;
+
+        std::string msg;
+        if (format == WireFormat::Json)
+        {
+            msg = fmt::format("[{}] {}: ", getTid(), event.name);
+            JsonWriter w(msg);
+            if (event.batch)
+                w.raw('[');
+            for (std::size_t i = 0; i < todos.size(); ++i)
+            {
+                if (i > 0)
+                    w.raw(',');
+                writeJson(w, *todos[i]);
+            }
+            if (event.batch)
+                w.raw(']');
+            frames.push_back(makeBroadcast(std::move(wire), std::move(msg), uWS::OpCode::TEXT));
+            continue;
+        }
+
+        BinaryWriter w(msg, format);
+        w.map(2).string("event").string(event.name).string("todos").array(static_cast<uint32_t>(todos.size()));
+        for (const auto* todo : todos)
+            writeBinary(w, *todo);
+        frames.push_back(makeBroadcast(std::move(wire), std::move(msg), uWS::OpCode::BINARY));
+    }
+}
+
+// The event message (moved, not copied, when unnumbered) or, for partial updates, the delta;
+// numbered events lead with "seq=N ".
+std::string TodoServer::eventText(TodoEvent& event, uint64_t seq)
+{
+    std::string msg = seq != 0 ? fmt::format("seq={} ", seq) : std::string();
+    if (event.delta)
+    {
+        fmt::format_to(std::back_inserter(msg), "[{}] {}: ", getTid(), event.name);
+        JsonWriter w(msg);
+        writeJson(w, *event.delta);
+    }
+    else if (seq == 0)
+        return std::move(event.message);
+    else
+        msg += event.message;
+    return msg;
+}
+
+// {"event", "todos"}, or {"event", "delta"} for partial updates; numbered events add "seq"
+std::string TodoServer::eventBinary(const TodoEvent& event, WireFormat format, uint64_t seq)
+{
+    std::string msg;
+    BinaryWriter w(msg, format);
+    w.map(seq != 0 ? 3 : 2).string("event").string(event.name);
+    if (seq != 0)
+        w.string("seq").number(seq);
+    if (event.delta)
+    {
+        w.string("delta");
+        writeBinary(w, *event.delta);
+    }
+    else
+    {
+        w.string("todos");
+        writeBinary(w, event.todos);
+    }
+    return msg;
+}
+
+// Sends a resubscribing client what it missed after `from`: the kept events, or the whole list as
+// a "resync" event numbered with the latest seq once some of them are gone. Events queued but not
+// yet published on this loop may arrive again afterwards, clients skip numbers they have seen.
+void TodoServer::resumeFeed(uWS::WebSocket<false, true, WsSession>* ws, uint64_t from)
+{
+    if (!this->replayFeed(ws, from))
+        this->sendResync(ws);
+}
+
+// the kept events after `from`, false when some of them are gone
+bool TodoServer::replayFeed(uWS::WebSocket<false, true, WsSession>* ws, uint64_t from)
+{
+    auto missed = this->m_changefeed->since(from);
+    if (!missed)
+        return false;
+
+    auto format = ws->getUserData()->format;
+    for (const auto& [seq, entry] : *missed)
+    {
+        if (format == WireFormat::Json)
+            ws->send(entry.text->message, uWS::OpCode::TEXT, entry.text->compress);
+        else
+            ws->send(eventBinary(*entry.event, format, seq), uWS::OpCode::BINARY);
+    }
+    return true;
+}
+
+// The whole list as a "resync" event, numbered with the latest seq when there is a changefeed
+void TodoServer::sendResync(uWS::WebSocket<false, true, WsSession>* ws)
+{
+    // events are numbered after the store applied them, so a later snapshot holds all up to `seq`
+    auto seq = this->m_changefeed ? this->m_changefeed->last() : 0;
+    auto snapshot = this->m_todos->snapshot();
+    auto format = ws->getUserData()->format;
+    std::string msg;
+    if (format == WireFormat::Json)
+    {
+        msg = seq != 0 ? fmt::format("seq={} [{}] resync: ", seq, getTid()) : fmt::format("[{}] resync: ", getTid());
+        TodoListWriter(std::move(snapshot)).next(msg, SIZE_MAX);
+    }
+    else
+    {
+        BinaryWriter w(msg, format);
+        w.map(seq != 0 ? 3 : 2).string("event").string("resync");
+        if (seq != 0)
+            w.string("seq").number(seq);
+        w.string("todos");
+        TodoListWriter(std::move(snapshot), std::nullopt, format).next(msg, SIZE_MAX);
+    }
+    auto opCode = format == WireFormat::Json ? uWS::OpCode::TEXT : uWS::OpCode::BINARY;
+    ws->send(msg, opCode, msg.size() >= kCompressMinBytes);
+}
+
+// Slow consumers
+
+// Runs after every wakeup that published on the loop. Sockets past the limit are closed or held
+// back; acting on them is left until the scan is done, as closing one changes the set.
+void TodoServer::checkBackpressure(WsLoop& loop)
+{
+    std::vector<uWS::WebSocket<false, true, WsSession>*> slow;
+    for (auto* ws : loop.sockets)
+        if (!ws->getUserData()->lagging && ws->getBufferedAmount() > this->m_backpressure.limit)
+            slow.push_back(ws);
+
+    for (auto* ws : slow)
+    {
+        this->m_slow_consumers.fetch_add(1, std::memory_order_relaxed);
+        if (this->m_backpressure.policy == SlowConsumer::Disconnect)
+        {
+            this->m_disconnects.fetch_add(1, std::memory_order_relaxed);
+            ws->getUserData()->lagging = true;
+            ws->end(1008, "slow consumer");
+        }
+        else
+            this->holdBack(ws);
+    }
+}
+
+// Takes a slow consumer off its topics, so nothing more is queued for it while it catches up
+void TodoServer::holdBack(uWS::WebSocket<false, true, WsSession>* ws)
+{
+    auto* data = ws->getUserData();
+    data->lagging = true;
+    data->lagSeq = this->m_changefeed ? this->m_changefeed->last() : 0;
+    ws->iterateTopics([data](std::string_view topic)
+                      { data->lagTopics.emplace_back(topic); });
+    for (const auto& topic : data->lagTopics)
+        ws->unsubscribe(topic);
+}
+
+// Called from the drain handler once a held back consumer is down to half the limit: its topics are
+// restored, then it gets a snapshot (Resync) or the newest mutation events it missed (DropOldest)
+void TodoServer::release(uWS::WebSocket<false, true, WsSession>* ws)
+{
+    auto* data = ws->getUserData();
+    auto topics = std::move(data->lagTopics);
+    data->lagTopics.clear();
+    data->lagging = false;
+
+    bool todos = false, mutation = false;
+    for (const auto& topic : topics)
+    {
+        ws->subscribe(topic);
+        todos = todos || topic != "random";
+        mutation = mutation || topic == formatTopic("mutation", data->format);
+    }
+    if (this->m_backpressure.policy == SlowConsumer::Resync && todos)
+    {
+        this->m_resyncs.fetch_add(1, std::memory_order_relaxed);
+        this->sendResync(ws);
+        return;
+    }
+    if (!mutation || !this->m_changefeed)
+        return;
+
+    auto last = this->m_changefeed->last();
+    auto keep = std::min<uint64_t>(this->m_backpressure.keepLatest, this->m_changefeed->capacity());
+    this->replayFeed(ws, std::max(data->lagSeq, last > keep ? last - keep : 0));
+}
+
+// Timer callback of a loop: publishes its per-topic queue depths
+void TodoServer::onSample(us_timer_t* timer)
+{
+    WsLoop* loop;
+    std::memcpy(&loop, us_timer_ext(timer), sizeof(loop));
+    loop->server->sampleDepths(*loop);
+}
+
+// a held back socket still counts for the topics it will be given back
+void TodoServer::sampleDepths(WsLoop& loop)
+{
+    std::unordered_map<std::string, TopicDepth> depths;
+    for (auto* ws : loop.sockets)
+    {
+        auto* data = ws->getUserData();
+        auto buffered = ws->getBufferedAmount();
+        auto count = [&depths, data, buffered](std::string_view topic)
         {
-            pair.second.publish(topic, message, uWS::OpCode::TEXT);
+            auto& depth = depths[std::string(topic)];
+            ++depth.sockets;
+            depth.buffered += buffered;
+            depth.lagging += data->lagging;
         };
-        loop->defer(defer);
+        if (data->lagging)
+            std::for_each(data->lagTopics.begin(), data->lagTopics.end(), count);
+        else
+            ws->iterateTopics(count);
     }
+
+    std::lock_guard lock(this->m_depth_mutex);
+    this->m_depths[loop.app_num] = std::move(depths);
 }
 
 #pragma endregion TodoServer
@@ -8,52 +8,167 @@
 #ifndef __TODOSERVER__H__
 #define __TODOSERVER__H__
 
-#include <uWebSockets/App.h>
-
-#include <shared_mutex>
+#include <array>
+#include <memory>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
-struct Todo
-{
-    uint id;
-    std::string description;
-    bool completed;
-};
-
-using Todos = std::shared_ptr<std::unordered_map<uint, Todo>>;
-using Apps = std::shared_ptr<std::unordered_map<uint, uWS::App>>;
+#include "Adt.h"
+#include "Broadcast.hpp"
+#include "Changefeed.hpp"
+#include "Wal.hpp"
 
-using TodoMutex = std::shared_mutex;
-
-// used for uWS::WebSocket type
-struct WsData
+// The library's per-socket data plus what this server tracks for each client
+struct WsSession : WsData
 {
-    std::string_view user_secure_token;
+    // set while the server holds the client back as a slow consumer
+    bool lagging = false;
+    uint64_t lagSeq = 0;  // changefeed position when it was held back
+    std::vector<std::string> lagTopics;  // its subscriptions, restored once it has drained
+    std::shared_ptr<bool> alive;  // made by the first RPC call, false once closed
 };
 
 class TodoServer
 {
 public:
-    TodoServer(Todos, TodoMutex&);
+    // Who a request is answered to: its HTTP response, or the ws client of an RPC call, by the id
+    // the call carried. `alive` turns false when that client closes before a durable reply.
+    struct Replier
+    {
+        Replier(uWS::HttpResponse<false>* res)
+            : res(res)
+        {
+        }
+
+        Replier(uWS::WebSocket<false, true, WsSession>* ws, std::shared_ptr<bool> alive, std::string rpcId)
+            : ws(ws), alive(std::move(alive)), rpcId(std::move(rpcId))
+        {
+        }
+
+        uWS::HttpResponse<false>* res = nullptr;
+        uWS::WebSocket<false, true, WsSession>* ws = nullptr;
+        std::shared_ptr<bool> alive{};
+        std::string rpcId{};
+    };
+
+    // with a `Wal`, mutations are answered only once their log record is durable
+    explicit TodoServer(Todos, std::shared_ptr<Wal> = nullptr);
 
     void startServer(uint app_num, int port);
 
-    // HTTP API Endpoints
-    void getTodo(uWS::HttpResponse<false>* res, uint todoId);
-    void deleteTodo(uWS::HttpResponse<false>* res, uint todoId);
-    void modifyTodo(uWS::HttpResponse<false>* res, uint todoId, const std::string& description, bool completed);
-    void getAllTodos(uWS::HttpResponse<false>* res);
+    // merges the broadcasts of `topic` into batched frames; call before startServer
+    void coalesceTopic(std::string topic, CoalescePolicy policy);
+
+    // numbers every "mutation" event and keeps the last `capacity` of them for subscribers
+    // resuming with "from_seq"; call before startServer
+    void enableChangefeed(std::size_t capacity);
+
+    // how slow ws consumers are treated; call before startServer
+    void limitBackpressure(BackpressurePolicy policy);
+
+    // HTTP API Endpoints, answering in the wire format the client accepts; the single-todo ones
+    // also serve ws RPC calls
+    void getTodo(Replier to, uint todoId, WireFormat format = WireFormat::Json);
+    void deleteTodo(Replier to, uint todoId, WireFormat format = WireFormat::Json);
+    void createTodo(Replier to, const std::string& description, bool completed, WireFormat format = WireFormat::Json);
+    void modifyTodo(Replier to, uint todoId, const std::string& description, bool completed, WireFormat format = WireFormat::Json);
+    void patchTodo(Replier to, uint todoId, TodoFields fields, WireFormat format = WireFormat::Json);
+    void createTodos(Replier to, std::vector<Todo> todos, WireFormat format = WireFormat::Json);
+    void modifyTodos(Replier to, const std::vector<Todo>& todos, WireFormat format = WireFormat::Json);
+    void deleteTodos(Replier to, const std::vector<uint>& todoIds, WireFormat format = WireFormat::Json);
+    void getAllTodos(uWS::HttpResponse<false>* res, std::optional<bool> completed = std::nullopt, std::string_view ifNoneMatch = {}, WireFormat format = WireFormat::Json, bool gzip = false);
+    void getTodoStats(uWS::HttpResponse<false>* res, WireFormat format = WireFormat::Json);
+    void getWsStats(uWS::HttpResponse<false>* res);
 
     // WebSocket Handling
-    void handleWebSocketConnection(uWS::WebSocket<false, true, WsData>* ws);
-    void handleWebSocketMessage(uWS::WebSocket<false, true, WsData>* ws, std::string_view message);
-    void handleWebSocketClose(uWS::WebSocket<false, true, WsData>* ws);
-    void broadcastMessage(const std::string& topic, const std::string& message);
+    void handleWebSocketConnection(uWS::WebSocket<false, true, WsSession>* ws);
+    void handleWebSocketMessage(uWS::WebSocket<false, true, WsSession>* ws, std::string_view message);
+    void handleWebSocketClose(uWS::WebSocket<false, true, WsSession>* ws);
+    void handleRpc(uWS::WebSocket<false, true, WsSession>* ws, const nlohmann::json& request);
+    void broadcastMessage(std::string topic, std::string message, uWS::OpCode opCode = uWS::OpCode::TEXT);
+    void broadcastMessage(BroadcastEventPtr event);
 
 private:
+    // What a request did, as told to its client and to ws subscribers: `message` for JSON
+    // clients, `todos` (kept only when some binary client needs them) encoded for the others.
+    // Partial updates carry their `delta`, which subscribers get instead of the whole todo.
+    // `relists` marks modifications that may have moved todos between the completed and active lists.
+    // `seq` is the changefeed number taken when the store applied it, 0 when nothing changed.
+    struct TodoEvent
+    {
+        std::string name{};
+        std::string message{};
+        std::vector<Todo> todos{};
+        bool batch = false;
+        std::optional<TodoFields> delta{};
+        bool relists = false;
+        uint64_t seq = 0;
+    };
+
+    TodoHook journal(WalOp op, Wal::Lsn& lsn, uint64_t& seq, std::string& json, std::vector<Todo>* todos = nullptr);
+    TodoHook journalBatch(WalOp op, Wal::Lsn& lsn, uint64_t& seq, std::string& list, std::vector<Todo>* todos = nullptr);
+    static std::string& closeList(std::string& list);
+    bool needsTodos(const Replier& to, WireFormat format) const;
+    void endDurable(Replier to, std::string topic, TodoEvent event, WireFormat format, Wal::Lsn lsn);
+    void reply(const Replier& to, const TodoEvent& event, WireFormat format);
+    void broadcastEvent(const std::string& topic, TodoEvent&& event);
+    void renderEvent(const std::string& topic, TodoEvent& event, uint64_t seq, std::vector<BroadcastEventPtr>& frames);
+    static std::string eventText(TodoEvent& event, uint64_t seq);
+    static std::string eventBinary(const TodoEvent& event, WireFormat format, uint64_t seq);
+    void renderScoped(const TodoEvent& event, std::vector<BroadcastEventPtr>& frames);
+    void renderScopedTo(const std::string& topic, const TodoEvent& event, const std::vector<const Todo*>& todos, std::vector<BroadcastEventPtr>& frames);
+    void resumeFeed(uWS::WebSocket<false, true, WsSession>* ws, uint64_t from);
+    bool replayFeed(uWS::WebSocket<false, true, WsSession>* ws, uint64_t from);
+    void sendResync(uWS::WebSocket<false, true, WsSession>* ws);
+
+    // open sockets of one worker loop, only touched on that loop
+    struct WsLoop
+    {
+        TodoServer* server;
+        uint app_num;
+        std::unordered_set<uWS::WebSocket<false, true, WsSession>*> sockets{};
+    };
+    void checkBackpressure(WsLoop& loop);
+    void holdBack(uWS::WebSocket<false, true, WsSession>* ws);
+    void release(uWS::WebSocket<false, true, WsSession>* ws);
+    void sampleDepths(WsLoop& loop);
+    static void onSample(us_timer_t* timer);
+
     Apps m_apps;
     Todos m_todos;
-    TodoMutex& m_mutex;
+    IdAllocator m_ids;
+    std::shared_ptr<Wal> m_wal;
+    // a kept "mutation" event: its published text frame, and the event for binary replays; `frames`
+    // wait there until every earlier event is out
+    struct FeedEntry
+    {
+        BroadcastEventPtr text;
+        std::shared_ptr<const TodoEvent> event;
+        std::vector<BroadcastEventPtr> frames{};
+    };
+    std::unique_ptr<Changefeed<FeedEntry>> m_changefeed;
+    Broadcaster<false> m_broadcaster;
+    // unfiltered "query" broadcast of the latest store version, shared by every worker
+    struct QueryFrame
+    {
+        uint64_t version;
+        BroadcastEventPtr event;
+    };
+    std::atomic<std::shared_ptr<const QueryFrame>> m_query_frame;
+    // "query" subscribers over every app, kept by the ws subscription handler
+    std::atomic<int> m_query_subscribers{0};
+    // subscriptions of binary clients, indexed by WireFormat
+    std::array<std::atomic<int>, 3> m_binary_subscribers{};
+    // subscribers of the "todo:<id>" and "todos:completed|active" topics, per wire topic
+    TopicInterest m_scoped;
+    BackpressurePolicy m_backpressure;
+    // latest queue depths sampled by every worker, per topic
+    std::mutex m_depth_mutex;
+    std::unordered_map<uint, std::unordered_map<std::string, TopicDepth>> m_depths;
+    std::atomic<uint64_t> m_slow_consumers{0};
+    std::atomic<uint64_t> m_resyncs{0};
+    std::atomic<uint64_t> m_disconnects{0};
 };
 
 using TodoServerPtr = std::shared_ptr<TodoServer>;
@@ -0,0 +1,206 @@
+/**
+ * @file:	SlowConsumer.cpp
+ * @author:	Jacob Xie
+ * @date:	2024/12/24 17:18:36 Tuesday
+ * @brief:	floods a deliberately slow websocket client and checks the slow consumer policy
+ **/
+
+#include <fmt/format.h>
+
+#include <thread>
+
+#include "TodoServer.h"
+#include "WsClient.hpp"
+
+namespace
+{
+constexpr unsigned int kLimit = 64 * 1024;
+constexpr std::size_t kKeepLatest = 16;
+constexpr std::size_t kCreates = 4000;
+constexpr std::size_t kWindow = 8;
+constexpr std::size_t kDescriptionBytes = 4000;
+
+int failures = 0;
+
+void check(bool ok, std::string_view what)
+{
+    fmt::print("{} {}\n", ok ? "ok  " : "FAIL", what);
+    failures += !ok;
+}
+
+// body of a plain HTTP GET over loopback
+std::string httpGet(uint16_t port, std::string_view path)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        throw std::runtime_error("httpGet: cannot connect");
+
+    auto request = fmt::format("GET {} HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n", path);
+    ::send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    std::string response;
+    char buffer[4096];
+    std::size_t end = std::string::npos, length = 0;
+    while (end == std::string::npos || response.size() < end + 4 + length)
+    {
+        auto n = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+            break;
+        response.append(buffer, static_cast<std::size_t>(n));
+        if (end == std::string::npos && (end = response.find("\r\n\r\n")) != std::string::npos)
+        {
+            auto at = response.find("Content-Length: ");
+            length = at < end ? std::stoul(response.substr(at + 16)) : 0;
+        }
+    }
+    ::close(fd);
+    return end == std::string::npos ? std::string() : response.substr(end + 4);
+}
+
+// "seq=N ..." prefix of a changefeed event, 0 for anything else
+uint64_t seqOf(std::string_view text)
+{
+    uint64_t seq = 0;
+    if (text.starts_with("seq="))
+        std::from_chars(text.data() + 4, text.data() + text.size(), seq);
+    return seq;
+}
+
+WsClient subscribe(uint16_t port, std::string_view topic, int rcvbuf = 0)
+{
+    WsClient client(port, "/", rcvbuf);
+    client.send(fmt::format(R"({{"action": "subscribe", "topic": "{}"}})", topic));
+    if (!client.waitFor([](uint8_t, const std::string& text)
+                        { return text.starts_with("Subscribed"); },
+                        5000))
+        throw std::runtime_error("subscription not acknowledged");
+    return client;
+}
+}  // namespace
+
+// One worker, a changefeed, and a 64 KiB limit. A fast client creates kCreates large todos over
+// ws RPC while a slow one, with a tiny receive buffer, subscribes to "mutation" and reads nothing.
+// The server's own buffer for the slow client must stay bounded, /ws/stats must report it, and
+// once it reads again it must see what its policy promises.
+//
+// usage: test_slow_consumer drop-oldest|resync|disconnect [port]
+int main(int argc, char** argv)
+{
+    std::string_view name = argc > 1 ? argv[1] : "resync";
+    auto port = static_cast<uint16_t>(argc > 2 ? std::atoi(argv[2]) : 9201);
+    BackpressurePolicy policy{kLimit, SlowConsumer::Resync, kKeepLatest};
+    if (name == "drop-oldest")
+        policy.policy = SlowConsumer::DropOldest;
+    else if (name == "disconnect")
+        policy.policy = SlowConsumer::Disconnect;
+
+    auto server = std::make_shared<TodoServer>(makeTodoStore("hash", 16));
+    server->enableChangefeed(kCreates);
+    server->limitBackpressure(policy);
+    std::thread([server, port]()
+                { server->startServer(1, port); })
+        .detach();
+
+    std::optional<WsClient> fast;
+    for (int attempt = 0; !fast && attempt < 100; ++attempt)
+    {
+        try
+        {
+            fast.emplace(subscribe(port, "mutation"));
+        }
+        catch (const std::exception&)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+    if (!fast)
+    {
+        fmt::print("FAIL server did not start on port {}\n", port);
+        std::_Exit(1);
+    }
+    auto slow = subscribe(port, "mutation", 4096);
+
+    // flood, keeping the fast client drained so only the slow one falls behind
+    uint64_t last_seq = 0;
+    std::size_t replies = 0;
+    std::string description(kDescriptionBytes, 'x');
+    for (std::size_t sent = 0; sent < kCreates;)
+    {
+        for (std::size_t i = 0; i < kWindow && sent < kCreates; ++i, ++sent)
+            fast->send(fmt::format(R"({{"id": {}, "op": "create", "todo": {{"description": "{}", "completed": false}}}})", sent, description));
+        while (replies < sent)
+        {
+            auto frame = fast->next(5000);
+            if (!frame)
+                break;
+            if (frame->second.starts_with(R"({"id":)"))
+                ++replies;
+            last_seq = std::max(last_seq, seqOf(frame->second));
+        }
+    }
+    check(replies == kCreates, fmt::format("fast client got {} of {} replies", replies, kCreates));
+
+    // let every worker sample its queues at least once
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    auto stats = nlohmann::json::parse(httpGet(port, "/ws/stats"), nullptr, false);
+    check(!stats.is_discarded(), "GET /ws/stats returns JSON");
+    if (stats.is_discarded())
+        std::_Exit(1);
+    fmt::print("     {}\n", stats.dump());
+    check(stats["slow_consumers"].get<uint64_t>() >= 1, "the slow client was detected");
+
+    if (policy.policy == SlowConsumer::Disconnect)
+    {
+        check(stats["disconnects"].get<uint64_t>() >= 1, "it was counted as disconnected");
+        bool closed = false;
+        try
+        {
+            closed = slow.waitFor([](uint8_t opcode, const std::string&)
+                                  { return opcode == 0x8; },
+                                  10'000);
+        }
+        catch (const std::exception&)
+        {
+            closed = true;
+        }
+        check(closed, "the slow client was closed");
+        std::_Exit(failures == 0 ? 0 : 1);
+    }
+
+    const auto& mutation = stats["topics"]["mutation"];
+    check(mutation["lagging"].get<int>() >= 1, "the mutation topic reports a held back socket");
+    // the hard cap is 2 * limit, plus at most the one frame that crossed it
+    check(mutation["buffered"].get<uint64_t>() <= 2 * kLimit + kDescriptionBytes + 1024,
+          fmt::format("its server-side buffer stayed bounded ({} bytes)", mutation["buffered"].get<uint64_t>()));
+
+    // read again: everything buffered, then what the policy sends once drained
+    std::size_t events = 0;
+    bool resynced = false;
+    uint64_t slow_seq = 0;
+    while (auto frame = slow.next(2000))
+    {
+        const auto& text = frame->second;
+        resynced = resynced || text.find("] resync: ") != std::string::npos;
+        if (text.find("] modifyTodo: ") != std::string::npos)
+            ++events;
+        slow_seq = std::max(slow_seq, seqOf(text));
+    }
+    fmt::print("     slow client read {} events, last seq {} of {}\n", events, slow_seq, last_seq);
+    check(events < kCreates, "the slow client skipped events");
+    check(slow_seq == last_seq, "it caught up to the latest event");
+    if (policy.policy == SlowConsumer::Resync)
+    {
+        check(resynced, "it was sent a resync snapshot");
+        auto after = nlohmann::json::parse(httpGet(port, "/ws/stats"), nullptr, false);
+        check(!after.is_discarded() && after["resyncs"].get<uint64_t>() >= 1, "the resync was counted");
+    }
+    else
+        check(!resynced && events >= kKeepLatest, "it was sent the newest events instead of a resync");
+
+    // the server loop never returns
+    std::_Exit(failures == 0 ? 0 : 1);
+}